@@ -0,0 +1,232 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_ASYNC_MATERIAL_BUILDER_H
+#define PXR_IMAGING_RPR_USD_ASYNC_MATERIAL_BUILDER_H
+
+#include "pxr/imaging/rprUsd/error.h"
+#include "pxr/imaging/rprUsd/fileReadAhead.h"
+#include "pxr/imaging/rprUsd/material.h"
+#include "pxr/imaging/rprUsd/materialCache.h"
+#include "pxr/base/gf/vec3f.h"
+#include "pxr/base/tf/getenv.h"
+#include "pxr/base/work/dispatcher.h"
+#include "pxr/usd/sdf/assetPath.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdPlaceholderMaterial
+///
+/// Plain diffuse material shown while the real material is being built.
+///
+class RprUsdPlaceholderMaterial : public RprUsdMaterial {
+public:
+    static GfVec3f GetFallbackColor() { return GfVec3f(0.18f); }
+
+    RprUsdPlaceholderMaterial(rpr::Context* context, GfVec3f const& color) {
+        rpr::Status status;
+        m_diffuseNode.reset(context->CreateMaterialNode(RPR_MATERIAL_NODE_DIFFUSE, &status));
+        if (!m_diffuseNode) {
+            RPR_ERROR_CHECK(status, "Failed to create placeholder material node");
+            return;
+        }
+        RPR_ERROR_CHECK(m_diffuseNode->SetInput(RPR_MATERIAL_INPUT_COLOR, color[0], color[1], color[2], 1.0f), "Failed to set placeholder color");
+        m_surfaceNode = m_diffuseNode.get();
+    }
+
+    ~RprUsdPlaceholderMaterial() override = default;
+
+private:
+    std::unique_ptr<rpr::MaterialNode> m_diffuseNode;
+};
+
+/// \class RprUsdAsyncMaterialBuilder
+///
+/// Spreads material building over several frames. Request returns a placeholder
+/// right away, built from the prim's display color, and the real materials are
+/// built by Commit within a time budget, so a scene with many materials starts
+/// rendering before all of them are built.
+///
+/// rpr::Context and the scene delegate may only be used from the thread that
+/// syncs the scene, so the network conversion, the RPR graph and the texture
+/// decode (done by RprUsdMaterialRegistry::CommitResources, which does not read
+/// RprUsdTextureDataPool) all stay on that thread. The only work moved to a
+/// worker is reading the referenced texture files ahead, so that the decode
+/// finds them in the OS file cache instead of waiting for the disk.
+///
+/// The time budget covers only the graph building in Commit. Materials built
+/// there merely enqueue their texture load requests, the textures are decoded
+/// later in RprUsdMaterialRegistry::CommitResources, all of them in one go. So
+/// the budget does not bound how long the first frame waits for texture decode.
+///
+/// Commit is expected to be called from the render delegate's CommitResources.
+/// It hands finished materials to the callback passed to Request. That
+/// callback swaps the material on the owner's side and re-attaches it with
+/// RprUsdMaterial::AttachTo, while rendering keeps converging with the placeholder.
+///
+/// Enabled with RPRUSD_ASYNC_MATERIALS=1.
+///
+class RprUsdAsyncMaterialBuilder {
+public:
+    using OnDidBuildMaterial = std::function<void(std::shared_ptr<RprUsdMaterial> const&)>;
+
+    static bool IsEnabled() {
+        static bool isEnabled = TfGetenvBool("RPRUSD_ASYNC_MATERIALS", false);
+        return isEnabled;
+    }
+
+    RprUsdAsyncMaterialBuilder(rpr::Context* rprContext, RprUsdMaterialCache* materialCache)
+        : m_rprContext(rprContext)
+        , m_materialCache(materialCache) {}
+
+    ~RprUsdAsyncMaterialBuilder() {
+        m_dispatcher.Cancel();
+        m_dispatcher.Wait();
+    }
+
+    /// Returns a placeholder for \p materialId and schedules building the real material.
+    /// A newer request for the same material supersedes the pending one.
+    std::shared_ptr<RprUsdMaterial> Request(
+        SdfPath const& materialId,
+        HdSceneDelegate* sceneDelegate,
+        HdMaterialNetworkMap const& networkMap,
+        GfVec3f const& displayColor,
+        OnDidBuildMaterial onDidBuildMaterial);
+
+    /// Drops the pending build of \p materialId, e.g. when the material prim is removed
+    void Cancel(SdfPath const& materialId);
+
+    /// Builds prepared materials until \p timeBudgetMs is spent, at least one per call.
+    /// Texture decode of the built materials is not counted, see the class doc.
+    /// Returns the number of materials built.
+    size_t Commit(double timeBudgetMs = 10.0);
+
+    /// True while some requests have not been committed yet
+    bool HasPendingRequests() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return !m_jobs.empty();
+    }
+
+private:
+    struct Job {
+        SdfPath materialId;
+        HdSceneDelegate* sceneDelegate;
+        HdMaterialNetworkMap networkMap;
+        OnDidBuildMaterial onDidBuildMaterial;
+
+        std::atomic<bool> isPrepared{false};
+    };
+
+    static void Prepare(Job* job);
+
+private:
+    rpr::Context* m_rprContext;
+    RprUsdMaterialCache* m_materialCache;
+
+    mutable std::mutex m_mutex;
+    std::map<SdfPath, std::shared_ptr<Job>> m_jobs;
+
+    WorkDispatcher m_dispatcher;
+};
+
+inline std::shared_ptr<RprUsdMaterial> RprUsdAsyncMaterialBuilder::Request(
+    SdfPath const& materialId,
+    HdSceneDelegate* sceneDelegate,
+    HdMaterialNetworkMap const& networkMap,
+    GfVec3f const& displayColor,
+    OnDidBuildMaterial onDidBuildMaterial) {
+    auto job = std::make_shared<Job>();
+    job->materialId = materialId;
+    job->sceneDelegate = sceneDelegate;
+    job->networkMap = networkMap;
+    job->onDidBuildMaterial = std::move(onDidBuildMaterial);
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs[materialId] = job;
+    }
+
+    m_dispatcher.Run([job]() { Prepare(job.get()); });
+
+    auto placeholder = std::make_shared<RprUsdPlaceholderMaterial>(m_rprContext, displayColor);
+    placeholder->SetName(materialId.GetText());
+    return placeholder;
+}
+
+inline void RprUsdAsyncMaterialBuilder::Prepare(Job* job) {
+    for (auto& entry : job->networkMap.map) {
+        for (auto& node : entry.second.nodes) {
+            for (auto& parameter : node.parameters) {
+                if (!parameter.second.IsHolding<SdfAssetPath>()) {
+                    continue;
+                }
+
+                auto& path = parameter.second.UncheckedGet<SdfAssetPath>().GetResolvedPath();
+                // UDIM sets are loaded tile by tile on demand
+                if (path.empty() || path.find("<UDIM>") != std::string::npos) {
+                    continue;
+                }
+
+                RprUsdReadFileAhead(path);
+            }
+        }
+    }
+    job->isPrepared = true;
+}
+
+inline void RprUsdAsyncMaterialBuilder::Cancel(SdfPath const& materialId) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.erase(materialId);
+}
+
+inline size_t RprUsdAsyncMaterialBuilder::Commit(double timeBudgetMs) {
+    auto startTime = std::chrono::steady_clock::now();
+    auto isOverBudget = [startTime, timeBudgetMs]() {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count() >= timeBudgetMs;
+    };
+
+    size_t numBuilt = 0;
+    while (numBuilt == 0 || !isOverBudget()) {
+        std::shared_ptr<Job> job;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto it = m_jobs.begin(); it != m_jobs.end(); ++it) {
+                if (it->second->isPrepared) {
+                    job = std::move(it->second);
+                    m_jobs.erase(it);
+                    break;
+                }
+            }
+        }
+        if (!job) {
+            break;
+        }
+
+        auto material = m_materialCache->GetMaterial(job->materialId, job->sceneDelegate, job->networkMap);
+        job->onDidBuildMaterial(material);
+        ++numBuilt;
+    }
+    return numBuilt;
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_ASYNC_MATERIAL_BUILDER_H
@@ -0,0 +1,312 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_COMMAND_QUEUE_H
+#define PXR_IMAGING_RPR_USD_COMMAND_QUEUE_H
+
+#include "pxr/imaging/rprUsd/error.h"
+#include "pxr/imaging/rprUsd/material.h"
+#include "pxr/imaging/rprUsd/materialHelpers.h"
+#include "pxr/usd/sdf/path.h"
+
+#include <RadeonProRender.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdRecordedObject
+///
+/// RPR object whose creation was recorded into RprUsdCommandQueue. It's empty
+/// until the queue is flushed and owns the object afterwards.
+///
+template <typename T>
+struct RprUsdRecordedObject {
+    std::unique_ptr<T> object;
+};
+
+/// \class RprUsdObjectRef
+///
+/// Reference to an RPR object that either exists already or is created by a
+/// command recorded earlier in the same queue. Resolved when the queue is flushed.
+///
+template <typename T>
+class RprUsdObjectRef {
+public:
+    RprUsdObjectRef(T* object) : m_object(object) {}
+    RprUsdObjectRef(std::shared_ptr<RprUsdRecordedObject<T>> recorded) : m_recorded(std::move(recorded)) {}
+
+    T* Get() const { return m_recorded ? m_recorded->object.get() : m_object; }
+
+private:
+    T* m_object = nullptr;
+    std::shared_ptr<RprUsdRecordedObject<T>> m_recorded;
+};
+
+/// \class RprUsdCommandQueue
+///
+/// rpr::Context is not thread-safe, so prims can only be synced in parallel if
+/// they do not call RPR directly. Instead, Sync records its RPR calls here,
+/// keyed by the prim id, and the thread that owns the context applies them
+/// with Flush, e.g. from the render delegate's CommitResources.
+///
+/// Every thread records into its own buffer, so recording takes no locks
+/// after the first command of a thread. Flush applies commands ordered by key
+/// and, for one key, in recording order, which makes the result independent
+/// of how prims were scheduled. This requires the commands of one key to be
+/// recorded from one thread, which holds for Hydra's per-prim sync tasks.
+/// Object creation is applied before all other commands, so a prim may
+/// reference an object recorded by another prim, e.g. a shared material node.
+///
+/// Recording must not overlap with Flush. Objects referenced by commands must
+/// stay alive until the queue is flushed.
+///
+class RprUsdCommandQueue {
+public:
+    using Command = std::function<rpr::Status(rpr::Context*)>;
+
+    enum Phase {
+        kCreate,
+        kModify
+    };
+
+    struct Stats {
+        size_t numFlushes = 0;
+        size_t numCommands = 0;
+        size_t numFailedCommands = 0;
+    };
+
+    RprUsdCommandQueue() : m_id(++GetIdCounter()) {}
+
+    RprUsdCommandQueue(RprUsdCommandQueue const&) = delete;
+    RprUsdCommandQueue& operator=(RprUsdCommandQueue const&) = delete;
+
+    /// Records \p command, \p messageOnFail is reported if it returns an error.
+    /// \p messageOnFail must be a string literal. Commands that create objects
+    /// other commands reference should be recorded in the kCreate phase.
+    void Record(SdfPath const& key, Command command, const char* messageOnFail, Phase phase = kModify);
+
+    std::shared_ptr<RprUsdRecordedObject<rpr::MaterialNode>> CreateMaterialNode(SdfPath const& key, rpr::MaterialNodeType type);
+
+    std::shared_ptr<RprUsdRecordedObject<rpr::Shape>> CreateShapeInstance(SdfPath const& key, RprUsdObjectRef<rpr::Shape> prototype);
+
+    void SetInput(SdfPath const& key, RprUsdObjectRef<rpr::MaterialNode> node, rpr::MaterialNodeInput input, RprUsdMaterialInputValue const& value);
+
+    void SetTransform(SdfPath const& key, RprUsdObjectRef<rpr::Shape> shape, std::array<float, 16> const& transform);
+
+    void SetVisibility(SdfPath const& key, RprUsdObjectRef<rpr::Shape> shape, bool visible);
+
+    void AttachMaterial(SdfPath const& key, std::shared_ptr<RprUsdMaterial> material, RprUsdObjectRef<rpr::Shape> shape, bool displacementEnabled);
+
+    void AttachShape(SdfPath const& key, rpr::Scene* scene, RprUsdObjectRef<rpr::Shape> shape);
+
+    /// Applies all recorded commands on the calling thread, which must own \p context.
+    /// Returns the number of failed commands.
+    size_t Flush(rpr::Context* context);
+
+    bool IsEmpty() const;
+
+    Stats GetStats() const {
+        std::lock_guard<std::mutex> lock(m_buffersMutex);
+        return m_stats;
+    }
+
+private:
+    struct RecordedCommand {
+        Phase phase;
+        SdfPath key;
+        size_t sequence;
+        Command command;
+        const char* messageOnFail;
+    };
+
+    struct Buffer {
+        std::vector<RecordedCommand> commands;
+    };
+
+    static std::atomic<uint64_t>& GetIdCounter() {
+        static std::atomic<uint64_t> counter{0};
+        return counter;
+    }
+
+    Buffer* GetThreadBuffer();
+
+private:
+    // Identifies the queue in thread-local caches, addresses might be reused
+    uint64_t m_id;
+
+    mutable std::mutex m_buffersMutex;
+    std::unordered_map<std::thread::id, std::unique_ptr<Buffer>> m_buffers;
+    Stats m_stats;
+};
+
+inline RprUsdCommandQueue::Buffer* RprUsdCommandQueue::GetThreadBuffer() {
+    struct CachedBuffer {
+        uint64_t queueId = 0;
+        Buffer* buffer = nullptr;
+    };
+    thread_local CachedBuffer cached;
+    if (cached.queueId == m_id) {
+        return cached.buffer;
+    }
+
+    std::lock_guard<std::mutex> lock(m_buffersMutex);
+    auto& buffer = m_buffers[std::this_thread::get_id()];
+    if (!buffer) {
+        buffer = std::make_unique<Buffer>();
+    }
+    cached.queueId = m_id;
+    cached.buffer = buffer.get();
+    return buffer.get();
+}
+
+inline void RprUsdCommandQueue::Record(SdfPath const& key, Command command, const char* messageOnFail, Phase phase) {
+    auto buffer = GetThreadBuffer();
+    buffer->commands.push_back({phase, key, buffer->commands.size(), std::move(command), messageOnFail});
+}
+
+inline std::shared_ptr<RprUsdRecordedObject<rpr::MaterialNode>> RprUsdCommandQueue::CreateMaterialNode(SdfPath const& key, rpr::MaterialNodeType type) {
+    auto recorded = std::make_shared<RprUsdRecordedObject<rpr::MaterialNode>>();
+    Record(key, [recorded, type](rpr::Context* context) {
+        rpr::Status status;
+        recorded->object.reset(context->CreateMaterialNode(type, &status));
+        return status;
+    }, "Failed to create material node", kCreate);
+    return recorded;
+}
+
+inline std::shared_ptr<RprUsdRecordedObject<rpr::Shape>> RprUsdCommandQueue::CreateShapeInstance(SdfPath const& key, RprUsdObjectRef<rpr::Shape> prototype) {
+    auto recorded = std::make_shared<RprUsdRecordedObject<rpr::Shape>>();
+    Record(key, [recorded, prototype](rpr::Context* context) {
+        auto prototypeShape = prototype.Get();
+        if (!prototypeShape) {
+            return rpr::Status(RPR_ERROR_INVALID_PARAMETER);
+        }
+        rpr::Status status;
+        recorded->object.reset(context->CreateShapeInstance(prototypeShape, &status));
+        return status;
+    }, "Failed to create shape instance", kCreate);
+    return recorded;
+}
+
+inline void RprUsdCommandQueue::SetInput(SdfPath const& key, RprUsdObjectRef<rpr::MaterialNode> node, rpr::MaterialNodeInput input, RprUsdMaterialInputValue const& value) {
+    Record(key, [node, input, value](rpr::Context*) {
+        auto rprNode = node.Get();
+        return rprNode ? value.Apply(rprNode, input) : rpr::Status(RPR_ERROR_INVALID_PARAMETER);
+    }, "Failed to set material node input");
+}
+
+inline void RprUsdCommandQueue::SetTransform(SdfPath const& key, RprUsdObjectRef<rpr::Shape> shape, std::array<float, 16> const& transform) {
+    Record(key, [shape, transform](rpr::Context*) {
+        auto rprShape = shape.Get();
+        return rprShape ? rprShape->SetTransform(transform.data(), false) : rpr::Status(RPR_ERROR_INVALID_PARAMETER);
+    }, "Failed to set shape transform");
+}
+
+inline void RprUsdCommandQueue::SetVisibility(SdfPath const& key, RprUsdObjectRef<rpr::Shape> shape, bool visible) {
+    Record(key, [shape, visible](rpr::Context*) {
+        auto rprShape = shape.Get();
+        return rprShape ? rprShape->SetVisibility(visible) : rpr::Status(RPR_ERROR_INVALID_PARAMETER);
+    }, "Failed to set shape visibility");
+}
+
+inline void RprUsdCommandQueue::AttachMaterial(SdfPath const& key, std::shared_ptr<RprUsdMaterial> material, RprUsdObjectRef<rpr::Shape> shape, bool displacementEnabled) {
+    Record(key, [material, shape, displacementEnabled](rpr::Context*) {
+        auto rprShape = shape.Get();
+        if (!rprShape) {
+            return rpr::Status(RPR_ERROR_INVALID_PARAMETER);
+        }
+        if (!material) {
+            RprUsdMaterial::DetachFrom(rprShape);
+            return rpr::Status(RPR_SUCCESS);
+        }
+        // AttachTo reports its own errors
+        material->AttachTo(rprShape, displacementEnabled);
+        return rpr::Status(RPR_SUCCESS);
+    }, "Failed to attach material");
+}
+
+inline void RprUsdCommandQueue::AttachShape(SdfPath const& key, rpr::Scene* scene, RprUsdObjectRef<rpr::Shape> shape) {
+    Record(key, [scene, shape](rpr::Context*) {
+        auto rprShape = shape.Get();
+        return rprShape ? scene->Attach(rprShape) : rpr::Status(RPR_ERROR_INVALID_PARAMETER);
+    }, "Failed to attach shape to scene");
+}
+
+inline bool RprUsdCommandQueue::IsEmpty() const {
+    std::lock_guard<std::mutex> lock(m_buffersMutex);
+    for (auto& entry : m_buffers) {
+        if (!entry.second->commands.empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline size_t RprUsdCommandQueue::Flush(rpr::Context* context) {
+    std::vector<RecordedCommand> commands;
+    {
+        std::lock_guard<std::mutex> lock(m_buffersMutex);
+        size_t numCommands = 0;
+        for (auto& entry : m_buffers) {
+            numCommands += entry.second->commands.size();
+        }
+        commands.reserve(numCommands);
+        for (auto& entry : m_buffers) {
+            auto& bufferCommands = entry.second->commands;
+            std::move(bufferCommands.begin(), bufferCommands.end(), std::back_inserter(commands));
+            bufferCommands.clear();
+        }
+    }
+
+    // Buffers are visited in an arbitrary order, restore a deterministic one
+    std::sort(commands.begin(), commands.end(),
+        [](RecordedCommand const& lhs, RecordedCommand const& rhs) {
+            if (lhs.phase != rhs.phase) {
+                return lhs.phase < rhs.phase;
+            }
+            if (lhs.key != rhs.key) {
+                return lhs.key < rhs.key;
+            }
+            return lhs.sequence < rhs.sequence;
+        }
+    );
+
+    size_t numFailed = 0;
+    for (auto& command : commands) {
+        auto status = command.command(context);
+        if (status != RPR_SUCCESS &&
+            RPR_ERROR_CHECK(status, TfStringPrintf("%s: %s", command.key.GetText(), command.messageOnFail).c_str(), context)) {
+            ++numFailed;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_buffersMutex);
+    ++m_stats.numFlushes;
+    m_stats.numCommands += commands.size();
+    m_stats.numFailedCommands += numFailed;
+    return numFailed;
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_COMMAND_QUEUE_H
@@ -0,0 +1,185 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_CONFIG_SNAPSHOT_H
+#define PXR_IMAGING_RPR_USD_CONFIG_SNAPSHOT_H
+
+#include "pxr/imaging/rprUsd/config.h"
+#include "pxr/base/arch/fileSystem.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdConfigSnapshot
+///
+/// Immutable copy of RprUsdConfig values. Get reads the current snapshot with
+/// atomic loads, readers touch the RprUsdConfig mutex only after it changed.
+///
+/// Writers change the config through Update, which holds the RprUsdConfig lock,
+/// applies the change and publishes a new snapshot. RprUsdConfig saves its
+/// file on every change, so changes made around the snapshot (e.g. through the
+/// prebuilt Python bindings by the usdview menu) are detected by the
+/// modification time of the config file. Get checks it at most every
+/// GetValidationInterval, GetLatest on every call and is meant for reads that
+/// happen rarely and must see the latest value, e.g. cache directories.
+///
+/// Replaced snapshots are retired, not freed: the config changes only on user
+/// action, and this way readers may keep the returned reference without
+/// reference counting.
+///
+/// Reader contention has not been benchmarked against RprUsdConfig::GetInstance.
+///
+class RprUsdConfigSnapshot {
+public:
+    std::string filePath;
+    bool isRestartWarningEnabled;
+    std::string textureCacheDir;
+    std::string kernelCacheDir;
+    std::string precompiledKernelDir;
+    std::string deviceConfigurationFilepath;
+
+    /// Current snapshot, created from RprUsdConfig on first use. Might lag
+    /// behind changes not made through Update by up to GetValidationInterval.
+    static RprUsdConfigSnapshot const& Get();
+
+    /// Current snapshot, republished first if the config file has changed
+    static RprUsdConfigSnapshot const& GetLatest();
+
+    /// Applies \p update to RprUsdConfig under its lock and publishes the result
+    static void Update(std::function<void(RprUsdConfig*)> const& update);
+
+    /// Publishes the current RprUsdConfig values
+    static void Refresh() { Update(nullptr); }
+
+    /// How often Get checks the config file for changes
+    static std::chrono::steady_clock::duration GetValidationInterval() { return std::chrono::milliseconds(100); }
+
+private:
+    explicit RprUsdConfigSnapshot(RprUsdConfig const* config)
+        : filePath(config->GetFilePath())
+        , isRestartWarningEnabled(config->IsRestartWarningEnabled())
+        , textureCacheDir(config->GetTextureCacheDir())
+        , kernelCacheDir(config->GetKernelCacheDir())
+        , precompiledKernelDir(config->GetPrecompiledKernelDir())
+        , deviceConfigurationFilepath(config->GetDeviceConfigurationFilepath()) {
+        if (!ArchGetModificationTime(filePath.c_str(), &m_fileModificationTime)) {
+            m_fileModificationTime = 0.0;
+        }
+    }
+
+    struct State {
+        std::atomic<RprUsdConfigSnapshot const*> current{nullptr};
+        // Steady clock time in ticks when Get checks the config file next
+        std::atomic<std::chrono::steady_clock::rep> nextValidationTime{0};
+
+        // Guards publishing, always taken before the RprUsdConfig lock
+        std::mutex publishMutex;
+        std::vector<std::unique_ptr<RprUsdConfigSnapshot const>> snapshots;
+    };
+
+    /// Must be called with State::publishMutex held
+    static void Publish(std::function<void(RprUsdConfig*)> const& update);
+
+    /// Republishes \p snapshot if the config file was modified after it was taken
+    static RprUsdConfigSnapshot const& Validate(RprUsdConfigSnapshot const* snapshot);
+
+    bool IsUpToDate() const {
+        double modificationTime;
+        if (!ArchGetModificationTime(filePath.c_str(), &modificationTime)) {
+            modificationTime = 0.0;
+        }
+        return modificationTime == m_fileModificationTime;
+    }
+
+    static State& GetState() {
+        static State state;
+        return state;
+    }
+
+    double m_fileModificationTime;
+};
+
+inline RprUsdConfigSnapshot const& RprUsdConfigSnapshot::Get() {
+    auto& state = GetState();
+    if (auto snapshot = state.current.load(std::memory_order_acquire)) {
+        auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+        auto nextValidationTime = state.nextValidationTime.load(std::memory_order_relaxed);
+        // Only the reader that moves the deadline checks the file
+        if (now < nextValidationTime ||
+            !state.nextValidationTime.compare_exchange_strong(nextValidationTime,
+                now + GetValidationInterval().count(),
+                std::memory_order_relaxed)) {
+            return *snapshot;
+        }
+        return Validate(snapshot);
+    }
+
+    std::lock_guard<std::mutex> publishLock(state.publishMutex);
+    // Another reader might have published the first snapshot while we were waiting
+    if (!state.current.load(std::memory_order_relaxed)) {
+        Publish(nullptr);
+    }
+    return *state.current.load(std::memory_order_relaxed);
+}
+
+inline RprUsdConfigSnapshot const& RprUsdConfigSnapshot::GetLatest() {
+    return Validate(&Get());
+}
+
+inline RprUsdConfigSnapshot const& RprUsdConfigSnapshot::Validate(RprUsdConfigSnapshot const* snapshot) {
+    if (snapshot->IsUpToDate()) {
+        return *snapshot;
+    }
+
+    auto& state = GetState();
+    std::lock_guard<std::mutex> publishLock(state.publishMutex);
+    // Another thread might have republished it while we were waiting
+    auto current = state.current.load(std::memory_order_relaxed);
+    if (current == snapshot) {
+        Publish(nullptr);
+        current = state.current.load(std::memory_order_relaxed);
+    }
+    return *current;
+}
+
+inline void RprUsdConfigSnapshot::Update(std::function<void(RprUsdConfig*)> const& update) {
+    std::lock_guard<std::mutex> publishLock(GetState().publishMutex);
+    Publish(update);
+}
+
+inline void RprUsdConfigSnapshot::Publish(std::function<void(RprUsdConfig*)> const& update) {
+    std::unique_ptr<RprUsdConfigSnapshot const> snapshot;
+    {
+        RprUsdConfig* config;
+        auto configLock = RprUsdConfig::GetInstance(&config);
+        if (update) {
+            update(config);
+        }
+        snapshot.reset(new RprUsdConfigSnapshot(config));
+    }
+
+    auto& state = GetState();
+    state.snapshots.push_back(std::move(snapshot));
+    state.current.store(state.snapshots.back().get(), std::memory_order_release);
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_CONFIG_SNAPSHOT_H
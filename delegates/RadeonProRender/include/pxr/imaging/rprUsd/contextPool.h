@@ -0,0 +1,249 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_CONTEXT_POOL_H
+#define PXR_IMAGING_RPR_USD_CONTEXT_POOL_H
+
+#include "pxr/imaging/rprUsd/configSnapshot.h"
+#include "pxr/imaging/rprUsd/contextHelpers.h"
+#include "pxr/imaging/rprUsd/contextMetadata.h"
+#include "pxr/base/tf/getenv.h"
+
+#include <RadeonProRender.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdContextPool
+///
+/// Creates RPR contexts ahead of time, so that switching render quality to
+/// another plugin or opening a second viewport does not wait for plugin
+/// loading, device setup and kernel cache validation.
+///
+/// Contexts are pooled by plugin type, requested creation flags, the other
+/// creation parameters of RprUsdContextMetadata and the contents of the render
+/// device configuration file RprUsdCreateContext reads (written by "Choose Render
+/// Device" in usdview). Pools created for another device configuration are
+/// destroyed on the next Prewarm or Acquire. Acquire hands out a ready
+/// context if there is one, waits for one that is being created, or creates
+/// a context on the calling thread otherwise. Each acquired context is
+/// replaced in the background, keeping the configured number of warm
+/// contexts per key. A miss fills the pool of its key after the caller's
+/// context is created.
+///
+/// Every pooled context holds device memory, so the pool is empty by default.
+/// RPRUSD_CONTEXT_POOL_SIZE sets how many contexts are kept per key. Contexts
+/// with GL interop are bound to the caller's GL context and are never pooled.
+///
+class RprUsdContextPool {
+public:
+    struct Stats {
+        size_t numHits = 0;
+        size_t numMisses = 0;
+        size_t numCreatedContexts = 0;
+    };
+
+    static RprUsdContextPool& GetInstance() {
+        static RprUsdContextPool instance(size_t(std::max(TfGetenvInt("RPRUSD_CONTEXT_POOL_SIZE", 0), 0)));
+        return instance;
+    }
+
+    explicit RprUsdContextPool(size_t poolSize) : m_poolSize(poolSize) {}
+    ~RprUsdContextPool();
+
+    RprUsdContextPool(RprUsdContextPool const&) = delete;
+    RprUsdContextPool& operator=(RprUsdContextPool const&) = delete;
+
+    /// Number of warm contexts kept per key
+    size_t GetPoolSize() const { return m_poolSize; }
+
+    /// Starts creating contexts for \p metadata in the background until the pool
+    /// of its key is full, e.g. for the plugins the user is likely to switch to
+    void Prewarm(RprUsdContextMetadata const& metadata);
+
+    /// Context for \p metadata, which is updated as RprUsdCreateContext does.
+    /// nullptr if the context can not be created.
+    std::unique_ptr<rpr::Context> Acquire(RprUsdContextMetadata* metadata);
+
+    /// Destroys all pooled contexts
+    void Clear();
+
+    Stats GetStats() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stats;
+    }
+
+private:
+    struct Key {
+        RprUsdPluginType pluginType;
+        rpr::CreationFlags creationFlags;
+        bool useOpenCL;
+        std::map<std::uint64_t, std::uint32_t> additionalIntProperties;
+        std::string deviceConfiguration;
+
+        Key(RprUsdContextMetadata const& metadata, std::string deviceConfiguration)
+            : pluginType(metadata.pluginType)
+            , creationFlags(metadata.creationFlags)
+            , useOpenCL(metadata.useOpenCL)
+            , additionalIntProperties(metadata.additionalIntProperties)
+            , deviceConfiguration(std::move(deviceConfiguration)) {}
+
+        bool operator<(Key const& rhs) const {
+            return std::tie(pluginType, creationFlags, useOpenCL, additionalIntProperties, deviceConfiguration) <
+                std::tie(rhs.pluginType, rhs.creationFlags, rhs.useOpenCL, rhs.additionalIntProperties, rhs.deviceConfiguration);
+        }
+    };
+
+    struct PooledContext {
+        std::unique_ptr<rpr::Context> context;
+        RprUsdContextMetadata metadata;
+    };
+    // Contexts in creation order, some of them might still be created
+    using Pools = std::map<Key, std::deque<std::future<PooledContext>>>;
+
+    /// Contents of the device configuration file, empty if there is none
+    static std::string ReadDeviceConfiguration() {
+        std::ifstream stream(RprUsdConfigSnapshot::GetLatest().deviceConfigurationFilepath, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+    }
+
+    static bool IsPoolable(RprUsdContextMetadata const& metadata) {
+        return metadata.pluginType != kPluginInvalid && !metadata.isGlInteropEnabled && !metadata.interopInfo;
+    }
+
+    static PooledContext Create(RprUsdContextMetadata metadata) {
+        PooledContext pooled;
+        pooled.context.reset(RprUsdCreateContext(&metadata));
+        pooled.metadata = std::move(metadata);
+        return pooled;
+    }
+
+    /// Must be called with m_mutex held
+    void Refill(Key const& key, RprUsdContextMetadata const& metadata);
+
+    /// Moves pools of other device configurations into \p stalePools,
+    /// must be called with m_mutex held
+    void TakeStalePools(std::string const& deviceConfiguration, Pools* stalePools);
+
+private:
+    size_t m_poolSize;
+
+    mutable std::mutex m_mutex;
+    Pools m_pools;
+    Stats m_stats;
+};
+
+inline RprUsdContextPool::~RprUsdContextPool() {
+    Clear();
+}
+
+inline void RprUsdContextPool::Refill(Key const& key, RprUsdContextMetadata const& metadata) {
+    auto& pool = m_pools[key];
+    while (pool.size() < m_poolSize) {
+        pool.push_back(std::async(std::launch::async, Create, metadata));
+        ++m_stats.numCreatedContexts;
+    }
+}
+
+inline void RprUsdContextPool::TakeStalePools(std::string const& deviceConfiguration, Pools* stalePools) {
+    for (auto it = m_pools.begin(); it != m_pools.end();) {
+        if (it->first.deviceConfiguration != deviceConfiguration) {
+            stalePools->insert(std::move(*it));
+            it = m_pools.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+inline void RprUsdContextPool::Prewarm(RprUsdContextMetadata const& metadata) {
+    if (!m_poolSize || !IsPoolable(metadata)) {
+        return;
+    }
+
+    Key key(metadata, ReadDeviceConfiguration());
+    // Destroyed outside of the lock, contexts that are still being created are waited for
+    Pools stalePools;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    TakeStalePools(key.deviceConfiguration, &stalePools);
+    Refill(key, metadata);
+}
+
+inline std::unique_ptr<rpr::Context> RprUsdContextPool::Acquire(RprUsdContextMetadata* metadata) {
+    if (!m_poolSize || !IsPoolable(*metadata)) {
+        return std::unique_ptr<rpr::Context>(RprUsdCreateContext(metadata));
+    }
+
+    // RprUsdCreateContext updates the metadata, keep the request for refilling
+    auto request = *metadata;
+    Key key(request, ReadDeviceConfiguration());
+    std::future<PooledContext> pooled;
+    Pools stalePools;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        TakeStalePools(key.deviceConfiguration, &stalePools);
+        auto& pool = m_pools[key];
+        // The oldest context is the most likely to be ready
+        if (!pool.empty()) {
+            pooled = std::move(pool.front());
+            pool.pop_front();
+            ++m_stats.numHits;
+            Refill(key, request);
+        } else {
+            ++m_stats.numMisses;
+        }
+    }
+    // Release the device memory of contexts on previously chosen devices before creating new ones
+    stalePools.clear();
+
+    if (pooled.valid()) {
+        auto result = pooled.get();
+        if (result.context) {
+            *metadata = std::move(result.metadata);
+            return std::move(result.context);
+        }
+        // Creation failed in the background, retry here so that errors reach the caller
+    }
+
+    std::unique_ptr<rpr::Context> context(RprUsdCreateContext(metadata));
+
+    // Refill only now to not compete with the context the caller is waiting for
+    if (context) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Refill(key, request);
+    }
+    return context;
+}
+
+inline void RprUsdContextPool::Clear() {
+    Pools pools;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        pools.swap(m_pools);
+    }
+    // Contexts that are still being created are waited for and destroyed with the futures
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_CONTEXT_POOL_H
@@ -19,6 +19,8 @@ limitations under the License.
 
 #include <RadeonProRender.hpp>
 
+#include <algorithm>
+#include <string>
 #include <vector>
 
 PXR_NAMESPACE_OPEN_SCOPE
@@ -85,6 +87,35 @@ private:
     std::vector<rpr::Image*> m_subImages;
 };
 
+/// Size in bytes of the base level of \p format texel data
+inline size_t RprUsdGetImageFormatPixelSize(rpr::ImageFormat const& format) {
+    switch (format.type) {
+        case RPR_COMPONENT_TYPE_FLOAT32: return format.num_components * 4;
+        case RPR_COMPONENT_TYPE_FLOAT16: return format.num_components * 2;
+        default: return format.num_components;
+    }
+}
+
+/// Gamma RPR should decode texels of \p format with, 8-bit images are treated as sRGB unless stated otherwise
+inline float RprUsdGetImageGamma(std::string const& colorspace, rpr::ImageFormat const& format) {
+    if (colorspace == "sRGB") {
+        return 2.2f;
+    } else if (colorspace.empty() || colorspace == "auto") {
+        return format.type == RPR_COMPONENT_TYPE_UINT8 ? 2.2f : 1.0f;
+    }
+    return 1.0f;
+}
+
+/// Estimated memory footprint of the base image, sub-images of UDIM images are not accounted
+inline size_t RprUsdGetImageByteSize(RprUsdCoreImage* image) {
+    if (!image) {
+        return 0;
+    }
+    auto desc = image->GetDesc();
+    size_t depth = std::max(desc.image_depth, 1u);
+    return size_t(desc.image_width) * desc.image_height * depth * RprUsdGetImageFormatPixelSize(image->GetFormat());
+}
+
 PXR_NAMESPACE_CLOSE_SCOPE
 
 #endif // PXR_IMAGING_RPR_USD_CORE_IMAGE_H
@@ -0,0 +1,40 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_FILE_READ_AHEAD_H
+#define PXR_IMAGING_RPR_USD_FILE_READ_AHEAD_H
+
+#include "pxr/pxr.h"
+#include "pxr/base/arch/fileSystem.h"
+
+#include <cstdio>
+#include <string>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// Reads \p filepath and discards the bytes, so that a later read on another
+/// thread finds the file in the OS file cache instead of waiting for the disk.
+/// Nothing is kept in memory. Missing files are ignored.
+inline void RprUsdReadFileAhead(std::string const& filepath) {
+    FILE* file = ArchOpenFile(filepath.c_str(), "rb");
+    if (!file) {
+        return;
+    }
+    char buffer[64 * 1024];
+    while (std::fread(buffer, 1, sizeof(buffer), file) == sizeof(buffer)) {}
+    std::fclose(file);
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_FILE_READ_AHEAD_H
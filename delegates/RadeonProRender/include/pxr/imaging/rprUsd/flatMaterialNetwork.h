@@ -0,0 +1,430 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_FLAT_MATERIAL_NETWORK_H
+#define PXR_IMAGING_RPR_USD_FLAT_MATERIAL_NETWORK_H
+
+#include "pxr/imaging/rprUsd/materialRegistry.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdFlatMaterialNetwork
+///
+/// Compact, read-only form of RprUsd_MaterialNetwork. Nodes, parameters,
+/// inputs, connections and terminals live in contiguous arrays addressed by
+/// index, all carved out of a single allocation that is released at once when
+/// the network is destroyed. Parameters and inputs of a node are spans sorted
+/// by name and looked up with a binary search.
+///
+/// Can be built directly from HdMaterialNetworkMap, without the map based
+/// intermediate representation.
+///
+/// Conversion and traversal have not been benchmarked against
+/// RprUsd_MaterialNetwork, and nothing in the material translation uses this
+/// form yet.
+///
+class RprUsdFlatMaterialNetwork {
+public:
+    static constexpr uint32_t kInvalidNode = std::numeric_limits<uint32_t>::max();
+
+    template <typename T>
+    class Span {
+    public:
+        Span() = default;
+        Span(T const* begin, T const* end) : m_begin(begin), m_end(end) {}
+
+        T const* begin() const { return m_begin; }
+        T const* end() const { return m_end; }
+        size_t size() const { return size_t(m_end - m_begin); }
+        bool empty() const { return m_begin == m_end; }
+        T const& operator[](size_t idx) const { return m_begin[idx]; }
+
+    private:
+        T const* m_begin = nullptr;
+        T const* m_end = nullptr;
+    };
+
+    struct Parameter {
+        TfToken name;
+        VtValue value;
+    };
+
+    struct Connection {
+        uint32_t upstreamNode;
+        TfToken upstreamOutputName;
+    };
+
+    struct Input {
+        TfToken name;
+        uint32_t connectionsBegin;
+        uint32_t connectionsEnd;
+    };
+
+    struct Node {
+        SdfPath path;
+        TfToken nodeTypeId;
+        uint32_t parametersBegin;
+        uint32_t parametersEnd;
+        uint32_t inputsBegin;
+        uint32_t inputsEnd;
+    };
+
+    struct Terminal {
+        TfToken name;
+        Connection connection;
+    };
+
+    RprUsdFlatMaterialNetwork() = default;
+    explicit RprUsdFlatMaterialNetwork(HdMaterialNetworkMap const& networkMap);
+    explicit RprUsdFlatMaterialNetwork(RprUsd_MaterialNetwork const& network);
+    ~RprUsdFlatMaterialNetwork() { Destroy(); }
+
+    RprUsdFlatMaterialNetwork(RprUsdFlatMaterialNetwork&& other) noexcept { *this = std::move(other); }
+    RprUsdFlatMaterialNetwork& operator=(RprUsdFlatMaterialNetwork&& other) noexcept;
+    RprUsdFlatMaterialNetwork(RprUsdFlatMaterialNetwork const&) = delete;
+    RprUsdFlatMaterialNetwork& operator=(RprUsdFlatMaterialNetwork const&) = delete;
+
+    Span<Node> GetNodes() const { return {m_nodes, m_nodes + m_numNodes}; }
+    Span<Terminal> GetTerminals() const { return {m_terminals, m_terminals + m_numTerminals}; }
+
+    Span<Parameter> GetParameters(Node const& node) const {
+        return {m_parameters + node.parametersBegin, m_parameters + node.parametersEnd};
+    }
+    Span<Input> GetInputs(Node const& node) const {
+        return {m_inputs + node.inputsBegin, m_inputs + node.inputsEnd};
+    }
+    Span<Connection> GetConnections(Input const& input) const {
+        return {m_connections + input.connectionsBegin, m_connections + input.connectionsEnd};
+    }
+
+    /// nullptr if \p node has no parameter \p name
+    VtValue const* FindParameter(Node const& node, TfToken const& name) const;
+
+    /// nullptr if \p node has no input \p name
+    Input const* FindInput(Node const& node, TfToken const& name) const;
+
+    /// Index of the node at \p path or kInvalidNode, linear in the number of nodes
+    uint32_t FindNode(SdfPath const& path) const;
+
+    /// Size in bytes of the single allocation backing the network
+    size_t GetArenaSize() const { return m_arenaSize; }
+
+    /// Expands the network back into the map based representation
+    void ToMaterialNetwork(RprUsd_MaterialNetwork* network) const;
+
+private:
+    struct Counts {
+        size_t numNodes = 0;
+        size_t numParameters = 0;
+        size_t numInputs = 0;
+        size_t numConnections = 0;
+        size_t numTerminals = 0;
+    };
+
+    void Allocate(Counts const& counts);
+    void Destroy();
+
+    template <typename T>
+    static size_t Reserve(size_t* arenaSize, size_t count) {
+        size_t offset = (*arenaSize + alignof(T) - 1) & ~(alignof(T) - 1);
+        *arenaSize = offset + sizeof(T) * count;
+        return offset;
+    }
+
+    template <typename T>
+    static void DestroyArray(T* array, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            array[i].~T();
+        }
+    }
+
+private:
+    char* m_arena = nullptr;
+    size_t m_arenaSize = 0;
+
+    // Elements are constructed in place as they are appended
+    Node* m_nodes = nullptr;
+    Parameter* m_parameters = nullptr;
+    Input* m_inputs = nullptr;
+    Connection* m_connections = nullptr;
+    Terminal* m_terminals = nullptr;
+    size_t m_numNodes = 0;
+    size_t m_numParameters = 0;
+    size_t m_numInputs = 0;
+    size_t m_numConnections = 0;
+    size_t m_numTerminals = 0;
+};
+
+inline void RprUsdFlatMaterialNetwork::Allocate(Counts const& counts) {
+    size_t arenaSize = 0;
+    size_t nodesOffset = Reserve<Node>(&arenaSize, counts.numNodes);
+    size_t parametersOffset = Reserve<Parameter>(&arenaSize, counts.numParameters);
+    size_t inputsOffset = Reserve<Input>(&arenaSize, counts.numInputs);
+    size_t connectionsOffset = Reserve<Connection>(&arenaSize, counts.numConnections);
+    size_t terminalsOffset = Reserve<Terminal>(&arenaSize, counts.numTerminals);
+    if (!arenaSize) {
+        return;
+    }
+
+    m_arena = static_cast<char*>(::operator new(arenaSize));
+    m_arenaSize = arenaSize;
+    m_nodes = reinterpret_cast<Node*>(m_arena + nodesOffset);
+    m_parameters = reinterpret_cast<Parameter*>(m_arena + parametersOffset);
+    m_inputs = reinterpret_cast<Input*>(m_arena + inputsOffset);
+    m_connections = reinterpret_cast<Connection*>(m_arena + connectionsOffset);
+    m_terminals = reinterpret_cast<Terminal*>(m_arena + terminalsOffset);
+}
+
+inline void RprUsdFlatMaterialNetwork::Destroy() {
+    DestroyArray(m_nodes, m_numNodes);
+    DestroyArray(m_parameters, m_numParameters);
+    DestroyArray(m_inputs, m_numInputs);
+    DestroyArray(m_connections, m_numConnections);
+    DestroyArray(m_terminals, m_numTerminals);
+    ::operator delete(m_arena);
+
+    m_arena = nullptr;
+    m_arenaSize = 0;
+    m_numNodes = m_numParameters = m_numInputs = m_numConnections = m_numTerminals = 0;
+}
+
+inline RprUsdFlatMaterialNetwork& RprUsdFlatMaterialNetwork::operator=(RprUsdFlatMaterialNetwork&& other) noexcept {
+    if (this != &other) {
+        Destroy();
+        std::swap(m_arena, other.m_arena);
+        std::swap(m_arenaSize, other.m_arenaSize);
+        std::swap(m_nodes, other.m_nodes);
+        std::swap(m_parameters, other.m_parameters);
+        std::swap(m_inputs, other.m_inputs);
+        std::swap(m_connections, other.m_connections);
+        std::swap(m_terminals, other.m_terminals);
+        std::swap(m_numNodes, other.m_numNodes);
+        std::swap(m_numParameters, other.m_numParameters);
+        std::swap(m_numInputs, other.m_numInputs);
+        std::swap(m_numConnections, other.m_numConnections);
+        std::swap(m_numTerminals, other.m_numTerminals);
+    }
+    return *this;
+}
+
+inline RprUsdFlatMaterialNetwork::RprUsdFlatMaterialNetwork(HdMaterialNetworkMap const& networkMap) {
+    // Nodes shared by several terminal networks are taken once, first occurrence wins
+    std::unordered_map<SdfPath, uint32_t, SdfPath::Hash> indices;
+    std::vector<HdMaterialNode const*> sourceNodes;
+    Counts counts;
+    for (auto& entry : networkMap.map) {
+        for (auto& node : entry.second.nodes) {
+            if (indices.emplace(node.path, uint32_t(sourceNodes.size())).second) {
+                sourceNodes.push_back(&node);
+                counts.numParameters += node.parameters.size();
+            }
+        }
+        if (!entry.second.nodes.empty()) {
+            ++counts.numTerminals;
+        }
+    }
+    counts.numNodes = sourceNodes.size();
+
+    struct Relationship {
+        uint32_t downstreamNode;
+        TfToken const* inputName;
+        uint32_t upstreamNode;
+        TfToken const* upstreamOutputName;
+    };
+    std::vector<Relationship> relationships;
+    for (auto& entry : networkMap.map) {
+        for (auto& relationship : entry.second.relationships) {
+            auto downstreamIt = indices.find(relationship.outputId);
+            if (downstreamIt == indices.end()) {
+                continue;
+            }
+            auto upstreamIt = indices.find(relationship.inputId);
+            relationships.push_back({
+                downstreamIt->second, &relationship.outputName,
+                upstreamIt != indices.end() ? upstreamIt->second : kInvalidNode, &relationship.inputName});
+        }
+    }
+
+    // Group connections by node and input, keeping authored connection order within an input
+    std::stable_sort(relationships.begin(), relationships.end(),
+        [](Relationship const& lhs, Relationship const& rhs) {
+            if (lhs.downstreamNode != rhs.downstreamNode) {
+                return lhs.downstreamNode < rhs.downstreamNode;
+            }
+            return *lhs.inputName < *rhs.inputName;
+        }
+    );
+    relationships.erase(std::unique(relationships.begin(), relationships.end(),
+        [](Relationship const& lhs, Relationship const& rhs) {
+            return lhs.downstreamNode == rhs.downstreamNode && *lhs.inputName == *rhs.inputName &&
+                lhs.upstreamNode == rhs.upstreamNode && *lhs.upstreamOutputName == *rhs.upstreamOutputName;
+        }
+    ), relationships.end());
+
+    counts.numConnections = relationships.size();
+    for (size_t i = 0; i < relationships.size(); ++i) {
+        if (i == 0 ||
+            relationships[i].downstreamNode != relationships[i - 1].downstreamNode ||
+            *relationships[i].inputName != *relationships[i - 1].inputName) {
+            ++counts.numInputs;
+        }
+    }
+
+    Allocate(counts);
+
+    size_t relationshipIdx = 0;
+    for (uint32_t nodeIdx = 0; nodeIdx < counts.numNodes; ++nodeIdx) {
+        auto sourceNode = sourceNodes[nodeIdx];
+
+        Node* node = new (m_nodes + m_numNodes++) Node();
+        node->path = sourceNode->path;
+        node->nodeTypeId = sourceNode->identifier;
+
+        // Parameters come from an ordered map, so they are already sorted
+        node->parametersBegin = uint32_t(m_numParameters);
+        for (auto& parameter : sourceNode->parameters) {
+            new (m_parameters + m_numParameters++) Parameter{parameter.first, parameter.second};
+        }
+        node->parametersEnd = uint32_t(m_numParameters);
+
+        node->inputsBegin = uint32_t(m_numInputs);
+        while (relationshipIdx < relationships.size() && relationships[relationshipIdx].downstreamNode == nodeIdx) {
+            Input* input = new (m_inputs + m_numInputs++) Input{*relationships[relationshipIdx].inputName, uint32_t(m_numConnections), 0};
+            while (relationshipIdx < relationships.size() &&
+                   relationships[relationshipIdx].downstreamNode == nodeIdx &&
+                   *relationships[relationshipIdx].inputName == input->name) {
+                auto& relationship = relationships[relationshipIdx++];
+                new (m_connections + m_numConnections++) Connection{relationship.upstreamNode, *relationship.upstreamOutputName};
+            }
+            input->connectionsEnd = uint32_t(m_numConnections);
+        }
+        node->inputsEnd = uint32_t(m_numInputs);
+    }
+
+    // Same as HdMaterialNetwork2 conversion: the last node of each network is its terminal
+    for (auto& entry : networkMap.map) {
+        if (!entry.second.nodes.empty()) {
+            uint32_t terminalNode = indices.at(entry.second.nodes.back().path);
+            new (m_terminals + m_numTerminals++) Terminal{entry.first, Connection{terminalNode, TfToken()}};
+        }
+    }
+}
+
+inline RprUsdFlatMaterialNetwork::RprUsdFlatMaterialNetwork(RprUsd_MaterialNetwork const& network) {
+    std::unordered_map<SdfPath, uint32_t, SdfPath::Hash> indices;
+    Counts counts;
+    for (auto& entry : network.nodes) {
+        indices.emplace(entry.first, uint32_t(counts.numNodes++));
+        counts.numParameters += entry.second.parameters.size();
+        counts.numInputs += entry.second.inputConnections.size();
+        for (auto& input : entry.second.inputConnections) {
+            counts.numConnections += input.second.size();
+        }
+    }
+    counts.numTerminals = network.terminals.size();
+
+    Allocate(counts);
+
+    auto getIndex = [&indices](SdfPath const& path) {
+        auto it = indices.find(path);
+        return it != indices.end() ? it->second : kInvalidNode;
+    };
+
+    for (auto& entry : network.nodes) {
+        Node* node = new (m_nodes + m_numNodes++) Node();
+        node->path = entry.first;
+        node->nodeTypeId = entry.second.nodeTypeId;
+
+        node->parametersBegin = uint32_t(m_numParameters);
+        for (auto& parameter : entry.second.parameters) {
+            new (m_parameters + m_numParameters++) Parameter{parameter.first, parameter.second};
+        }
+        node->parametersEnd = uint32_t(m_numParameters);
+
+        node->inputsBegin = uint32_t(m_numInputs);
+        for (auto& input : entry.second.inputConnections) {
+            Input* flatInput = new (m_inputs + m_numInputs++) Input{input.first, uint32_t(m_numConnections), 0};
+            for (auto& connection : input.second) {
+                new (m_connections + m_numConnections++) Connection{getIndex(connection.upstreamNode), connection.upstreamOutputName};
+            }
+            flatInput->connectionsEnd = uint32_t(m_numConnections);
+        }
+        node->inputsEnd = uint32_t(m_numInputs);
+    }
+
+    for (auto& terminal : network.terminals) {
+        new (m_terminals + m_numTerminals++) Terminal{terminal.first,
+            Connection{getIndex(terminal.second.upstreamNode), terminal.second.upstreamOutputName}};
+    }
+}
+
+inline VtValue const* RprUsdFlatMaterialNetwork::FindParameter(Node const& node, TfToken const& name) const {
+    auto parameters = GetParameters(node);
+    auto it = std::lower_bound(parameters.begin(), parameters.end(), name,
+        [](Parameter const& parameter, TfToken const& name) { return parameter.name < name; });
+    return it != parameters.end() && it->name == name ? &it->value : nullptr;
+}
+
+inline RprUsdFlatMaterialNetwork::Input const* RprUsdFlatMaterialNetwork::FindInput(Node const& node, TfToken const& name) const {
+    auto inputs = GetInputs(node);
+    auto it = std::lower_bound(inputs.begin(), inputs.end(), name,
+        [](Input const& input, TfToken const& name) { return input.name < name; });
+    return it != inputs.end() && it->name == name ? it : nullptr;
+}
+
+inline uint32_t RprUsdFlatMaterialNetwork::FindNode(SdfPath const& path) const {
+    for (size_t i = 0; i < m_numNodes; ++i) {
+        if (m_nodes[i].path == path) {
+            return uint32_t(i);
+        }
+    }
+    return kInvalidNode;
+}
+
+inline void RprUsdFlatMaterialNetwork::ToMaterialNetwork(RprUsd_MaterialNetwork* network) const {
+    auto getPath = [this](uint32_t nodeIdx) {
+        return nodeIdx < m_numNodes ? m_nodes[nodeIdx].path : SdfPath();
+    };
+
+    network->nodes.clear();
+    network->terminals.clear();
+
+    for (auto& node : GetNodes()) {
+        auto& outNode = network->nodes[node.path];
+        outNode.nodeTypeId = node.nodeTypeId;
+        for (auto& parameter : GetParameters(node)) {
+            outNode.parameters.emplace_hint(outNode.parameters.end(), parameter.name, parameter.value);
+        }
+        for (auto& input : GetInputs(node)) {
+            auto& connections = outNode.inputConnections[input.name];
+            for (auto& connection : GetConnections(input)) {
+                connections.push_back({getPath(connection.upstreamNode), connection.upstreamOutputName});
+            }
+        }
+    }
+
+    for (auto& terminal : GetTerminals()) {
+        network->terminals[terminal.name] = {getPath(terminal.connection.upstreamNode), terminal.connection.upstreamOutputName};
+    }
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_FLAT_MATERIAL_NETWORK_H
@@ -0,0 +1,478 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_IMAGE_RETENTION_CACHE_H
+#define PXR_IMAGING_RPR_USD_IMAGE_RETENTION_CACHE_H
+
+#include "pxr/imaging/rprUsd/imageCache.h"
+#include "pxr/imaging/rprUsd/textureContentHash.h"
+#include "pxr/imaging/rprUsd/textureFileWatcher.h"
+#include "pxr/base/tf/getenv.h"
+
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdImageRetentionCache
+///
+/// Strong-reference tier on top of RprUsdImageCache. RprUsdImageCache keeps only
+/// weak handles, so an image is destroyed as soon as the last material releases it
+/// and has to be decoded and uploaded again on the next request. The retention
+/// cache keeps recently used images alive up to a byte budget and evicts the least
+/// recently used ones once the budget is exceeded.
+///
+/// Lookups are still routed through RprUsdImageCache so that outdated image files
+/// are detected the same way as before. When a RprUsdTextureFileWatcher is set,
+/// retained images are returned without touching RprUsdImageCache, and so without
+/// any file system calls; the watcher drops them once their files change.
+///
+/// With content deduplication enabled (RPRUSD_IMAGE_CONTENT_DEDUP) textures are
+/// additionally identified by the hash of their file bytes, so byte-identical
+/// files under different paths share one RprUsdCoreImage. Files with equal hashes
+/// are compared byte by byte before a new path is allowed to share an image.
+///
+/// RprUsdImageCache is not thread-safe, so GetImage calls are serialized as a
+/// whole. Invalidate may be called from any thread, e.g. by the file watcher.
+///
+class RprUsdImageRetentionCache {
+public:
+    struct Stats {
+        size_t numHits = 0;
+        size_t numMisses = 0;
+        size_t numEvictions = 0;
+        size_t numRetainedImages = 0;
+        size_t retainedBytes = 0;
+        size_t byteBudget = 0;
+
+        /// Lookups served by an image loaded from a byte-identical file under another path
+        size_t numContentHits = 0;
+        /// Image memory currently saved by content deduplication
+        size_t contentSharedBytes = 0;
+    };
+
+    /// Budget is read from RPRUSD_IMAGE_RETENTION_BUDGET_MB, zero disables retention
+    static size_t GetDefaultByteBudget() {
+        int budgetMb = TfGetenvInt("RPRUSD_IMAGE_RETENTION_BUDGET_MB", 0);
+        return budgetMb > 0 ? size_t(budgetMb) << 20 : 0;
+    }
+
+    explicit RprUsdImageRetentionCache(RprUsdImageCache* imageCache, size_t byteBudget = GetDefaultByteBudget())
+        : m_imageCache(imageCache)
+        , m_byteBudget(byteBudget)
+        , m_isContentDedupEnabled(TfGetenvBool("RPRUSD_IMAGE_CONTENT_DEDUP", false)) {}
+    ~RprUsdImageRetentionCache() { SetFileWatcher(nullptr); }
+
+    RprUsdImageRetentionCache(RprUsdImageRetentionCache const&) = delete;
+    RprUsdImageRetentionCache& operator=(RprUsdImageRetentionCache const&) = delete;
+
+    /// \p fileWatcher must outlive this cache or be reset before it is destroyed
+    void SetFileWatcher(RprUsdTextureFileWatcher* fileWatcher);
+
+    std::shared_ptr<RprUsdCoreImage> GetImage(
+        std::string const& path,
+        std::string const& colorspace,
+        rpr::ImageWrapType wrapType,
+        std::vector<RprUsdCoreImage::UDIMTile> const& tiles,
+        uint32_t numComponentsRequired);
+
+    void SetByteBudget(size_t byteBudget);
+    size_t GetByteBudget() const;
+
+    void SetContentDeduplication(bool enable);
+    bool IsContentDeduplicationEnabled() const;
+
+    /// Releases all retained images. Images still referenced elsewhere stay alive.
+    void Clear();
+
+    /// Releases retained images of \p path so that the next lookup reloads it
+    void Invalidate(std::string const& path);
+
+    Stats GetStats() const;
+    void ResetStats();
+
+private:
+    struct Key {
+        std::string path;
+        std::string colorspace;
+        rpr::ImageWrapType wrapType;
+        uint32_t numComponentsRequired;
+        std::vector<uint32_t> tileIds;
+
+        bool operator==(Key const& rhs) const {
+            return wrapType == rhs.wrapType && numComponentsRequired == rhs.numComponentsRequired &&
+                colorspace == rhs.colorspace && path == rhs.path && tileIds == rhs.tileIds;
+        }
+
+        struct Hash {
+            size_t operator()(Key const& key) const {
+                size_t hash = std::hash<std::string>{}(key.path);
+                hash ^= std::hash<std::string>{}(key.colorspace) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+                hash ^= std::hash<int>{}(key.wrapType) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+                hash ^= std::hash<uint32_t>{}(key.numComponentsRequired) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+                for (uint32_t tileId : key.tileIds) {
+                    hash ^= std::hash<uint32_t>{}(tileId) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+                }
+                return hash;
+            }
+        };
+    };
+
+    struct Entry {
+        Key key;
+        std::shared_ptr<RprUsdCoreImage> image;
+        size_t numBytes;
+    };
+    using EntryList = std::list<Entry>;
+
+    struct ContentKey {
+        uint64_t contentHash;
+        std::string colorspace;
+        rpr::ImageWrapType wrapType;
+        uint32_t numComponentsRequired;
+
+        bool operator==(ContentKey const& rhs) const {
+            return contentHash == rhs.contentHash && wrapType == rhs.wrapType &&
+                numComponentsRequired == rhs.numComponentsRequired && colorspace == rhs.colorspace;
+        }
+
+        struct Hash {
+            size_t operator()(ContentKey const& key) const {
+                size_t hash = size_t(key.contentHash);
+                hash ^= std::hash<std::string>{}(key.colorspace) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+                hash ^= std::hash<int>{}(key.wrapType) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+                hash ^= std::hash<uint32_t>{}(key.numComponentsRequired) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+                return hash;
+            }
+        };
+    };
+
+    struct ContentEntry {
+        std::weak_ptr<RprUsdCoreImage> image;
+        size_t numBytes;
+        // Files the image was loaded from, one per UDIM tile
+        std::vector<std::string> files;
+        // Paths verified to have the same content as files
+        std::set<std::string> paths;
+    };
+
+    void Evict(size_t byteBudget);
+    void WatchFiles(std::string const& path, std::vector<RprUsdCoreImage::UDIMTile> const& tiles);
+    static std::vector<std::string> GetFiles(std::string const& path, std::vector<RprUsdCoreImage::UDIMTile> const& tiles);
+    bool GetContentHash(std::vector<std::string> const& files, std::vector<RprUsdCoreImage::UDIMTile> const& tiles, uint64_t* hash);
+
+private:
+    // Serializes GetImage and SetFileWatcher, taken before m_mutex.
+    // Guards m_imageCache and m_fileWatcher.
+    std::mutex m_lookupMutex;
+    RprUsdImageCache* m_imageCache;
+
+    RprUsdTextureFileWatcher* m_fileWatcher = nullptr;
+    size_t m_fileWatcherListenerId = 0;
+
+    // Guards everything below, may be taken by the file watcher's thread
+    mutable std::mutex m_mutex;
+    size_t m_byteBudget;
+    size_t m_retainedBytes = 0;
+
+    // Front is the most recently used entry
+    EntryList m_lru;
+    std::unordered_map<Key, EntryList::iterator, Key::Hash> m_entries;
+
+    size_t m_numHits = 0;
+    size_t m_numMisses = 0;
+    size_t m_numEvictions = 0;
+
+    bool m_isContentDedupEnabled;
+    RprUsdTextureContentHasher m_contentHasher;
+    std::unordered_map<ContentKey, ContentEntry, ContentKey::Hash> m_contentEntries;
+    size_t m_numContentHits = 0;
+};
+
+inline std::shared_ptr<RprUsdCoreImage> RprUsdImageRetentionCache::GetImage(
+    std::string const& path,
+    std::string const& colorspace,
+    rpr::ImageWrapType wrapType,
+    std::vector<RprUsdCoreImage::UDIMTile> const& tiles,
+    uint32_t numComponentsRequired) {
+    std::lock_guard<std::mutex> lookupLock(m_lookupMutex);
+
+    Key key{path, colorspace, wrapType, numComponentsRequired, {}};
+    key.tileIds.reserve(tiles.size());
+    for (auto& tile : tiles) {
+        key.tileIds.push_back(tile.id);
+    }
+
+    if (m_fileWatcher) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(key);
+        if (it != m_entries.end()) {
+            ++m_numHits;
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            return it->second->image;
+        }
+    }
+
+    std::shared_ptr<RprUsdCoreImage> image;
+
+    std::vector<std::string> files;
+    ContentKey contentKey{0, colorspace, wrapType, numComponentsRequired};
+    bool isContentKeyValid = false;
+    if (IsContentDeduplicationEnabled()) {
+        files = GetFiles(path, tiles);
+        isContentKeyValid = GetContentHash(files, tiles, &contentKey.contentHash);
+    }
+
+    if (isContentKeyValid) {
+        std::vector<std::string> contentFiles;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_contentEntries.find(contentKey);
+            if (it != m_contentEntries.end()) {
+                image = it->second.image.lock();
+                if (!image) {
+                    m_contentEntries.erase(it);
+                } else if (!it->second.paths.count(path)) {
+                    contentFiles = it->second.files;
+                }
+            }
+        }
+
+        // An equal hash alone is not enough to share another file's image
+        if (!contentFiles.empty()) {
+            bool isEqual = contentFiles.size() == files.size();
+            for (size_t i = 0; isEqual && i < files.size(); ++i) {
+                isEqual = RprUsdTextureContentHasher::AreFilesEqual(files[i], contentFiles[i]);
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_contentEntries.find(contentKey);
+            if (isEqual && it != m_contentEntries.end() && it->second.image.lock() == image) {
+                it->second.paths.insert(path);
+                ++m_numContentHits;
+            } else {
+                image = nullptr;
+            }
+        }
+    }
+
+    if (!image) {
+        image = m_imageCache->GetImage(path, colorspace, wrapType, tiles, numComponentsRequired);
+
+        if (image && isContentKeyValid) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto& contentEntry = m_contentEntries[contentKey];
+            if (contentEntry.image.lock() != image) {
+                contentEntry.image = image;
+                contentEntry.numBytes = RprUsdGetImageByteSize(image.get()) * std::max<size_t>(1, tiles.size());
+                contentEntry.files = files;
+                contentEntry.paths.clear();
+            }
+            contentEntry.paths.insert(path);
+        }
+    }
+
+    if (image && m_fileWatcher && m_byteBudget) {
+        WatchFiles(path, tiles);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_entries.find(key);
+    if (it != m_entries.end()) {
+        auto entryIt = it->second;
+        if (entryIt->image == image) {
+            ++m_numHits;
+            m_lru.splice(m_lru.begin(), m_lru, entryIt);
+            return image;
+        }
+
+        // The image cache has reloaded outdated files, drop the stale handle
+        m_retainedBytes -= entryIt->numBytes;
+        m_lru.erase(entryIt);
+        m_entries.erase(it);
+    }
+    ++m_numMisses;
+
+    if (!image || !m_byteBudget) {
+        return image;
+    }
+
+    size_t numBytes = RprUsdGetImageByteSize(image.get()) * std::max<size_t>(1, tiles.size());
+    if (numBytes > m_byteBudget) {
+        return image;
+    }
+
+    m_lru.push_front(Entry{std::move(key), image, numBytes});
+    m_entries.emplace(m_lru.front().key, m_lru.begin());
+    m_retainedBytes += numBytes;
+    Evict(m_byteBudget);
+
+    return image;
+}
+
+inline void RprUsdImageRetentionCache::Evict(size_t byteBudget) {
+    while (m_retainedBytes > byteBudget && !m_lru.empty()) {
+        auto& entry = m_lru.back();
+        m_retainedBytes -= entry.numBytes;
+        m_entries.erase(entry.key);
+        m_lru.pop_back();
+        ++m_numEvictions;
+    }
+}
+
+inline void RprUsdImageRetentionCache::SetFileWatcher(RprUsdTextureFileWatcher* fileWatcher) {
+    std::lock_guard<std::mutex> lookupLock(m_lookupMutex);
+    if (m_fileWatcher) {
+        m_fileWatcher->RemoveListener(m_fileWatcherListenerId);
+    }
+
+    m_fileWatcher = fileWatcher;
+    if (m_fileWatcher) {
+        m_fileWatcherListenerId = m_fileWatcher->AddListener(
+            [this](std::string const& path) {
+                Invalidate(path);
+            }
+        );
+    }
+
+    // Retained images were not watched so far, and those that were may not be watched anymore
+    Clear();
+}
+
+inline void RprUsdImageRetentionCache::WatchFiles(std::string const& path, std::vector<RprUsdCoreImage::UDIMTile> const& tiles) {
+    for (auto& file : GetFiles(path, tiles)) {
+        m_fileWatcher->Watch(file, path);
+    }
+}
+
+inline std::vector<std::string> RprUsdImageRetentionCache::GetFiles(
+    std::string const& path,
+    std::vector<RprUsdCoreImage::UDIMTile> const& tiles) {
+    std::string formatString;
+    if (tiles.empty() || !RprUsdGetUDIMFormatString(path, &formatString)) {
+        return {path};
+    }
+
+    std::vector<std::string> files;
+    files.reserve(tiles.size());
+    for (auto& tile : tiles) {
+        files.push_back(TfStringPrintf(formatString.c_str(), tile.id));
+    }
+    return files;
+}
+
+inline bool RprUsdImageRetentionCache::GetContentHash(
+    std::vector<std::string> const& files,
+    std::vector<RprUsdCoreImage::UDIMTile> const& tiles,
+    uint64_t* hash) {
+    if (files.size() != tiles.size()) {
+        return m_contentHasher.GetHash(files[0], hash);
+    }
+
+    // UDIM textures are equal only if they consist of the same tiles with equal content
+    uint64_t udimHash = 0;
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        uint64_t tileHash;
+        if (!m_contentHasher.GetHash(files[i], &tileHash)) {
+            return false;
+        }
+        udimHash ^= std::hash<uint64_t>{}(tileHash ^ tiles[i].id) + 0x9e3779b9 + (udimHash << 6) + (udimHash >> 2);
+    }
+    *hash = udimHash;
+    return true;
+}
+
+inline void RprUsdImageRetentionCache::Invalidate(std::string const& path) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto it = m_lru.begin(); it != m_lru.end();) {
+        if (it->key.path == path) {
+            m_retainedBytes -= it->numBytes;
+            m_entries.erase(it->key);
+            it = m_lru.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto& entry : m_contentEntries) {
+        entry.second.paths.erase(path);
+    }
+}
+
+inline void RprUsdImageRetentionCache::SetByteBudget(size_t byteBudget) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_byteBudget = byteBudget;
+    Evict(m_byteBudget);
+}
+
+inline size_t RprUsdImageRetentionCache::GetByteBudget() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_byteBudget;
+}
+
+inline void RprUsdImageRetentionCache::SetContentDeduplication(bool enable) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_isContentDedupEnabled = enable;
+    if (!enable) {
+        m_contentEntries.clear();
+    }
+}
+
+inline bool RprUsdImageRetentionCache::IsContentDeduplicationEnabled() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_isContentDedupEnabled;
+}
+
+inline void RprUsdImageRetentionCache::Clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+    m_lru.clear();
+    m_retainedBytes = 0;
+    m_contentEntries.clear();
+}
+
+inline RprUsdImageRetentionCache::Stats RprUsdImageRetentionCache::GetStats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats stats;
+    stats.numHits = m_numHits;
+    stats.numMisses = m_numMisses;
+    stats.numEvictions = m_numEvictions;
+    stats.numRetainedImages = m_entries.size();
+    stats.retainedBytes = m_retainedBytes;
+    stats.byteBudget = m_byteBudget;
+    stats.numContentHits = m_numContentHits;
+    for (auto& entry : m_contentEntries) {
+        if (!entry.second.image.expired() && entry.second.paths.size() > 1) {
+            stats.contentSharedBytes += entry.second.numBytes * (entry.second.paths.size() - 1);
+        }
+    }
+    return stats;
+}
+
+inline void RprUsdImageRetentionCache::ResetStats() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_numHits = 0;
+    m_numMisses = 0;
+    m_numEvictions = 0;
+    m_numContentHits = 0;
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_IMAGE_RETENTION_CACHE_H
@@ -0,0 +1,416 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_KERNEL_CACHE_MANAGER_H
+#define PXR_IMAGING_RPR_USD_KERNEL_CACHE_MANAGER_H
+
+#include "pxr/imaging/rprUsd/configSnapshot.h"
+#include "pxr/base/arch/defines.h"
+#include "pxr/base/arch/fileSystem.h"
+#include "pxr/base/js/json.h"
+#include "pxr/base/tf/diagnostic.h"
+#include "pxr/base/tf/fileUtils.h"
+#include "pxr/base/tf/getenv.h"
+#include "pxr/base/tf/stringUtils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdKernelCacheManager
+///
+/// Keeps the RPR kernel cache directory within a size limit. Clearing the
+/// whole cache forces all kernels to be recompiled, which takes minutes, so
+/// instead the least recently used entries are evicted until the cache fits.
+///
+/// An entry is either a compiled kernel "<name>.bin" together with its
+/// "<name>.bin.check" file or a standalone "<name>.cache" file. A kernel whose
+/// check file is missing, empty or older than the kernel itself was not
+/// written completely and is removed, as are check files without a kernel.
+/// Kernels modified in the last ten minutes are left alone, another session
+/// might still be writing them.
+///
+/// Entry sizes and last use times are kept in an index file next to the
+/// entries. RPR loads kernels by itself, so the last use of an entry is taken
+/// from the access time of its file, which RPR updates on every load: it is the
+/// latest of the entry's modification time, access time and MarkUsed call.
+/// File systems that do not record access times (noatime mounts, NTFS with
+/// last access updates disabled) leave only the modification time, and eviction
+/// then degrades to least recently written first. Scanning only stats files and
+/// does not update access times itself. The index format is shared with the rpr.kernelCacheManager Python module,
+/// which provides the same operations to usdview and on the command line.
+///
+/// The size limit defaults to RPRUSD_KERNEL_CACHE_MAX_SIZE_MB (4096).
+///
+class RprUsdKernelCacheManager {
+    static constexpr int kIndexVersion = 1;
+    static constexpr double kWriteGracePeriod = 600.0;
+
+public:
+    struct Entry {
+        std::string name;
+        uint64_t size = 0;
+        double lastUseTime = 0.0;
+    };
+
+    struct Stats {
+        size_t numEntries = 0;
+        uint64_t totalSize = 0;
+        size_t numEvictedEntries = 0;
+        uint64_t evictedSize = 0;
+        size_t numCorruptEntries = 0;
+    };
+
+    static std::string GetDefaultCacheDir() {
+        return RprUsdConfigSnapshot::GetLatest().kernelCacheDir;
+    }
+
+    static uint64_t GetDefaultMaxSize() {
+        return uint64_t(std::max(TfGetenvInt("RPRUSD_KERNEL_CACHE_MAX_SIZE_MB", 4096), 0)) << 20;
+    }
+
+    static const char* GetIndexFileName() { return "rprUsdKernelCacheIndex.json"; }
+
+    explicit RprUsdKernelCacheManager(
+        std::string cacheDir = GetDefaultCacheDir(),
+        uint64_t maxSize = GetDefaultMaxSize())
+        : m_cacheDir(std::move(cacheDir))
+        , m_maxSize(maxSize) {}
+
+    std::string const& GetCacheDir() const { return m_cacheDir; }
+
+    uint64_t GetMaxSize() const { return m_maxSize; }
+    void SetMaxSize(uint64_t maxSize) { m_maxSize = maxSize; }
+
+    /// Synchronizes the index with the directory and removes corrupt entries
+    void Scan();
+
+    /// Marks the entry \p name (e.g. "<hash>.bin") as used now
+    void MarkUsed(std::string const& name);
+
+    /// Scans the directory and evicts the least recently used entries until the
+    /// cache fits into the size limit. Returns the number of evicted entries.
+    size_t Trim();
+
+    /// Removes all entries
+    size_t Clear();
+
+    /// Entries ordered from the least to the most recently used
+    std::vector<Entry> GetEntries() const;
+
+    Stats GetStats() const;
+
+private:
+    static bool IsKernel(std::string const& name) { return TfStringEndsWith(name, ".bin"); }
+    static bool IsCheck(std::string const& name) { return TfStringEndsWith(name, ".bin.check"); }
+    static bool IsStandalone(std::string const& name) { return TfStringEndsWith(name, ".cache"); }
+
+    static double GetCurrentTime() {
+        return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    static bool GetAccessTime(std::string const& path, double* time) {
+#ifdef ARCH_OS_WINDOWS
+        struct _stat64 st;
+        if (_stat64(path.c_str(), &st) != 0) {
+            return false;
+        }
+#else
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            return false;
+        }
+#endif
+        *time = double(st.st_atime);
+        return true;
+    }
+
+    std::string GetPath(std::string const& name) const { return TfStringCatPaths(m_cacheDir, name); }
+
+    bool IsCorrupt(std::string const& kernelName) const;
+    void RemoveEntry(std::string const& name);
+
+    void LoadIndex();
+    void SaveIndex() const;
+
+private:
+    std::string m_cacheDir;
+    uint64_t m_maxSize;
+
+    mutable std::mutex m_mutex;
+    std::map<std::string, Entry> m_entries;
+    bool m_isIndexLoaded = false;
+
+    size_t m_numEvictedEntries = 0;
+    uint64_t m_evictedSize = 0;
+    size_t m_numCorruptEntries = 0;
+};
+
+inline bool RprUsdKernelCacheManager::IsCorrupt(std::string const& kernelName) const {
+    auto kernelPath = GetPath(kernelName);
+    auto checkPath = kernelPath + ".check";
+
+    double kernelTime, checkTime;
+    if (!ArchGetModificationTime(kernelPath.c_str(), &kernelTime) ||
+        GetCurrentTime() - kernelTime < kWriteGracePeriod) {
+        return false;
+    }
+    if (ArchGetFileLength(kernelPath.c_str()) <= 0 ||
+        ArchGetFileLength(checkPath.c_str()) <= 0 ||
+        !ArchGetModificationTime(checkPath.c_str(), &checkTime)) {
+        return true;
+    }
+    // RPR writes the check file after the kernel
+    return checkTime < kernelTime;
+}
+
+inline void RprUsdKernelCacheManager::RemoveEntry(std::string const& name) {
+    TfDeleteFile(GetPath(name));
+    if (IsKernel(name)) {
+        TfDeleteFile(GetPath(name + ".check"));
+    }
+    m_entries.erase(name);
+}
+
+inline void RprUsdKernelCacheManager::Scan() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    LoadIndex();
+
+    std::vector<std::string> files;
+    TfReadDir(m_cacheDir, nullptr, &files, nullptr);
+    std::sort(files.begin(), files.end());
+
+    std::map<std::string, Entry> entries;
+    for (auto& name : files) {
+        if (IsCheck(name)) {
+            double checkTime;
+            if (!std::binary_search(files.begin(), files.end(), name.substr(0, name.size() - 6)) &&
+                ArchGetModificationTime(GetPath(name).c_str(), &checkTime) &&
+                GetCurrentTime() - checkTime >= kWriteGracePeriod) {
+                TfDeleteFile(GetPath(name));
+            }
+            continue;
+        }
+        if (!IsKernel(name) && !IsStandalone(name)) {
+            continue;
+        }
+
+        if (IsKernel(name) && IsCorrupt(name)) {
+            TF_WARN("Removing corrupt RPR kernel cache entry: %s", GetPath(name).c_str());
+            RemoveEntry(name);
+            ++m_numCorruptEntries;
+            continue;
+        }
+
+        // Another session might have removed the entry since the directory was read
+        auto path = GetPath(name);
+        double modificationTime;
+        if (!ArchGetModificationTime(path.c_str(), &modificationTime)) {
+            continue;
+        }
+
+        // Kernels within the write grace period might have no check file yet
+        Entry entry;
+        entry.name = name;
+        entry.size = uint64_t(std::max<int64_t>(ArchGetFileLength(path.c_str()), 0));
+        if (IsKernel(name)) {
+            entry.size += uint64_t(std::max<int64_t>(ArchGetFileLength((path + ".check").c_str()), 0));
+        }
+
+        // RPR reads the kernel but not necessarily its check file, so the kernel's access time is the one that counts
+        double accessTime = 0.0;
+        GetAccessTime(path, &accessTime);
+
+        auto it = m_entries.find(name);
+        entry.lastUseTime = std::max({modificationTime, accessTime, it != m_entries.end() ? it->second.lastUseTime : 0.0});
+
+        entries.emplace(name, std::move(entry));
+    }
+    m_entries = std::move(entries);
+
+    SaveIndex();
+}
+
+inline void RprUsdKernelCacheManager::MarkUsed(std::string const& name) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    LoadIndex();
+
+    auto it = m_entries.find(name);
+    if (it != m_entries.end()) {
+        it->second.lastUseTime = GetCurrentTime();
+        SaveIndex();
+    }
+}
+
+inline size_t RprUsdKernelCacheManager::Trim() {
+    Scan();
+
+    auto entries = GetEntries();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t totalSize = 0;
+    for (auto& entry : entries) {
+        totalSize += entry.size;
+    }
+
+    size_t numEvicted = 0;
+    for (auto& entry : entries) {
+        if (totalSize <= m_maxSize) {
+            break;
+        }
+        RemoveEntry(entry.name);
+        totalSize -= entry.size;
+        m_evictedSize += entry.size;
+        ++numEvicted;
+    }
+    m_numEvictedEntries += numEvicted;
+
+    if (numEvicted) {
+        SaveIndex();
+    }
+    return numEvicted;
+}
+
+inline size_t RprUsdKernelCacheManager::Clear() {
+    Scan();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t numRemoved = m_entries.size();
+    while (!m_entries.empty()) {
+        RemoveEntry(m_entries.begin()->first);
+    }
+    SaveIndex();
+    return numRemoved;
+}
+
+inline std::vector<RprUsdKernelCacheManager::Entry> RprUsdKernelCacheManager::GetEntries() const {
+    std::vector<Entry> entries;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        entries.reserve(m_entries.size());
+        for (auto& entry : m_entries) {
+            entries.push_back(entry.second);
+        }
+    }
+    std::stable_sort(entries.begin(), entries.end(),
+        [](Entry const& lhs, Entry const& rhs) { return lhs.lastUseTime < rhs.lastUseTime; });
+    return entries;
+}
+
+inline RprUsdKernelCacheManager::Stats RprUsdKernelCacheManager::GetStats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats stats;
+    stats.numEntries = m_entries.size();
+    for (auto& entry : m_entries) {
+        stats.totalSize += entry.second.size;
+    }
+    stats.numEvictedEntries = m_numEvictedEntries;
+    stats.evictedSize = m_evictedSize;
+    stats.numCorruptEntries = m_numCorruptEntries;
+    return stats;
+}
+
+inline void RprUsdKernelCacheManager::LoadIndex() {
+    if (m_isIndexLoaded) {
+        return;
+    }
+    m_isIndexLoaded = true;
+
+    std::ifstream stream(GetPath(GetIndexFileName()));
+    if (!stream) {
+        return;
+    }
+
+    auto root = JsParseStream(stream);
+    if (!root.IsObject()) {
+        return;
+    }
+
+    auto& object = root.GetJsObject();
+    auto versionIt = object.find("version");
+    auto entriesIt = object.find("entries");
+    if (versionIt == object.end() || !versionIt->second.IsInt() || versionIt->second.GetInt() != kIndexVersion ||
+        entriesIt == object.end() || !entriesIt->second.IsObject()) {
+        return;
+    }
+
+    for (auto& item : entriesIt->second.GetJsObject()) {
+        if (!item.second.IsObject()) {
+            continue;
+        }
+
+        auto& entryObject = item.second.GetJsObject();
+        auto lastUseIt = entryObject.find("lastUse");
+        if (lastUseIt == entryObject.end() || !lastUseIt->second.IsReal()) {
+            continue;
+        }
+
+        Entry entry;
+        entry.name = item.first;
+        entry.lastUseTime = lastUseIt->second.GetReal();
+        m_entries.emplace(item.first, std::move(entry));
+    }
+}
+
+inline void RprUsdKernelCacheManager::SaveIndex() const {
+    JsObject entries;
+    for (auto& entry : m_entries) {
+        JsObject entryObject;
+        entryObject["size"] = JsValue(int64_t(entry.second.size));
+        entryObject["lastUse"] = JsValue(entry.second.lastUseTime);
+        entries[entry.first] = JsValue(entryObject);
+    }
+
+    JsObject root;
+    root["version"] = JsValue(kIndexVersion);
+    root["entries"] = JsValue(entries);
+
+    // Replace atomically, the Python module or another session might read or save the index in the meantime.
+    // ArchMakeTmpFile picks a name no other session uses.
+    auto indexPath = GetPath(GetIndexFileName());
+    std::string tmpPath;
+    int tmpFile = ArchMakeTmpFile(m_cacheDir, GetIndexFileName(), &tmpPath);
+    if (tmpFile == -1) {
+        return;
+    }
+    ArchCloseFile(tmpFile);
+    {
+        std::ofstream stream(tmpPath);
+        if (stream) {
+            JsWriteToStream(JsValue(root), stream);
+        }
+        if (!stream) {
+            stream.close();
+            std::remove(tmpPath.c_str());
+            return;
+        }
+    }
+    if (std::rename(tmpPath.c_str(), indexPath.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+    }
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_KERNEL_CACHE_MANAGER_H
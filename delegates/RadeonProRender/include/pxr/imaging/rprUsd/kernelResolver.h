@@ -0,0 +1,303 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_KERNEL_RESOLVER_H
+#define PXR_IMAGING_RPR_USD_KERNEL_RESOLVER_H
+
+#include "pxr/imaging/rprUsd/configSnapshot.h"
+#include "pxr/base/arch/fileSystem.h"
+#include "pxr/base/js/json.h"
+#include "pxr/base/tf/diagnostic.h"
+#include "pxr/base/tf/fileUtils.h"
+#include "pxr/base/tf/stringUtils.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// Renderer features of a scene. Only contours and curves decide which kernel
+/// binaries are needed. The other flags only pick the define set reported by
+/// RprUsdPrecompiledKernelResolver::GetDefines, since a used kernel brings all
+/// of its variant binaries.
+struct RprUsdKernelFeatures {
+    /// Selects the THN_ENABLE_VOLUME define, does not narrow the binaries
+    bool volumes = false;
+    /// Selects the ENABLE_MATX define, does not narrow the binaries
+    bool materialX = false;
+    /// Selects the ENABLE_MOTION_BLUR define, does not narrow the binaries
+    bool motionBlur = false;
+    /// Contour kernels are needed only with contour rendering
+    bool contours = false;
+    /// Curve kernels are needed only with curves
+    bool curves = false;
+
+    bool operator==(RprUsdKernelFeatures const& rhs) const {
+        return volumes == rhs.volumes && materialX == rhs.materialX && motionBlur == rhs.motionBlur &&
+            contours == rhs.contours && curves == rhs.curves;
+    }
+};
+
+/// \class RprUsdPrecompiledKernelResolver
+///
+/// Works out which precompiled Northstar kernels a scene needs from
+/// AllPreCompilations.json in the precompiled kernel directory. The manifest
+/// lists for every kernel the defines it's always compiled with ("Always"),
+/// the optional defines it has variants for ("NotAlways") and the defines
+/// that do not affect it ("Ignores").
+///
+/// For given features the resolver returns the kernels that are used at all,
+/// the define set of the variant each of them needs, and the binaries of those
+/// kernels. Kernels are left out only by name: contour kernels without contour
+/// rendering and curve kernels without curves.
+///
+/// Binaries are named "<kernel>_<hash>.<backend>bin", with the hash computed
+/// by RPR from the define set. The hash is opaque to us, so a used kernel
+/// brings all of its variants: volumes, MaterialX and motion blur never change
+/// the returned binaries.
+///
+/// Nothing calls the resolver at context creation yet, RPR still loads the
+/// whole precompiled kernel directory.
+///
+/// The manifest is parsed once per directory.
+///
+class RprUsdPrecompiledKernelResolver {
+public:
+    enum Backend {
+        kHip,
+        kCuda
+    };
+
+    struct Kernel {
+        /// Kernel name as used in binary file names, e.g. "IntegratorGpuSimpleKernel"
+        std::string name;
+        std::vector<std::string> alwaysDefines;
+        std::vector<std::string> optionalDefines;
+        std::vector<std::string> ignoredDefines;
+    };
+
+    /// Shared resolver of \p precompiledKernelDir, nullptr if the directory has no manifest
+    static std::shared_ptr<RprUsdPrecompiledKernelResolver const> Get(
+        std::string const& precompiledKernelDir = RprUsdConfigSnapshot::Get().precompiledKernelDir);
+
+    static const char* GetManifestFileName() { return "AllPreCompilations.json"; }
+
+    std::string const& GetDirectory() const { return m_directory; }
+
+    std::vector<Kernel> const& GetKernels() const { return m_kernels; }
+
+    /// True if \p kernel is executed at all when rendering with \p features
+    static bool IsUsed(Kernel const& kernel, RprUsdKernelFeatures const& features);
+
+    /// Defines of the variant of \p kernel that renders \p features
+    static std::vector<std::string> GetDefines(Kernel const& kernel, RprUsdKernelFeatures const& features);
+
+    /// Kernels used with \p features
+    std::vector<Kernel const*> GetUsedKernels(RprUsdKernelFeatures const& features) const;
+
+    /// Binaries of the kernels used with \p features, sorted
+    std::vector<std::string> GetBinaries(RprUsdKernelFeatures const& features, Backend backend) const;
+
+    /// Checks that every kernel used with \p features has a non-empty binary,
+    /// names of kernels without one are written to \p missingKernels
+    bool Validate(RprUsdKernelFeatures const& features, Backend backend, std::vector<std::string>* missingKernels = nullptr) const;
+
+private:
+    RprUsdPrecompiledKernelResolver(std::string directory) : m_directory(std::move(directory)) {}
+
+    bool Load();
+
+    static const char* GetExtension(Backend backend) { return backend == kHip ? ".hipbin" : ".cudabin"; }
+    static bool IsFeatureDefine(std::string const& define, const char* featureDefine);
+    static bool IsFeatureEnabled(std::string const& define, RprUsdKernelFeatures const& features, bool* isFeature);
+
+    std::string GetBinaryPrefix(Kernel const& kernel) const { return kernel.name + "_"; }
+
+private:
+    std::string m_directory;
+    std::vector<Kernel> m_kernels;
+
+    // Binary file names by backend, sorted
+    std::vector<std::string> m_binaries[2];
+};
+
+inline std::shared_ptr<RprUsdPrecompiledKernelResolver const> RprUsdPrecompiledKernelResolver::Get(std::string const& precompiledKernelDir) {
+    static std::mutex mutex;
+    static std::map<std::string, std::shared_ptr<RprUsdPrecompiledKernelResolver const>> resolvers;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = resolvers.find(precompiledKernelDir);
+    if (it != resolvers.end()) {
+        return it->second;
+    }
+
+    std::shared_ptr<RprUsdPrecompiledKernelResolver> resolver(new RprUsdPrecompiledKernelResolver(precompiledKernelDir));
+    if (!resolver->Load()) {
+        resolver = nullptr;
+    }
+    resolvers.emplace(precompiledKernelDir, resolver);
+    return resolver;
+}
+
+inline bool RprUsdPrecompiledKernelResolver::Load() {
+    auto manifestPath = TfStringCatPaths(m_directory, GetManifestFileName());
+    std::ifstream stream(manifestPath);
+    if (!stream) {
+        return false;
+    }
+
+    JsParseError error;
+    auto root = JsParseStream(stream, &error);
+    if (!root.IsObject()) {
+        TF_WARN("Failed to parse %s:%u:%u: %s", manifestPath.c_str(), error.line, error.column, error.reason.c_str());
+        return false;
+    }
+
+    auto getStrings = [](JsObject const& object, const char* name) {
+        std::vector<std::string> strings;
+        auto it = object.find(name);
+        if (it != object.end() && it->second.IsArray()) {
+            for (auto& value : it->second.GetJsArray()) {
+                if (value.IsString()) {
+                    strings.push_back(value.GetString());
+                }
+            }
+        }
+        return strings;
+    };
+
+    for (auto& item : root.GetJsObject()) {
+        if (!item.second.IsObject()) {
+            continue;
+        }
+
+        // Keys are source paths with an optional variant index,
+        // e.g. "../TahoeNext/Core/CuKernels/RayCastCurveKernel#1"
+        auto name = TfGetBaseName(item.first);
+        name = name.substr(0, name.find('#'));
+
+        Kernel kernel;
+        kernel.name = std::move(name);
+        kernel.alwaysDefines = getStrings(item.second.GetJsObject(), "Always");
+        kernel.optionalDefines = getStrings(item.second.GetJsObject(), "NotAlways");
+        kernel.ignoredDefines = getStrings(item.second.GetJsObject(), "Ignores");
+        m_kernels.push_back(std::move(kernel));
+    }
+
+    std::vector<std::string> files;
+    TfReadDir(m_directory, nullptr, &files, nullptr);
+    for (auto backend : {kHip, kCuda}) {
+        for (auto& file : files) {
+            if (TfStringEndsWith(file, GetExtension(backend))) {
+                m_binaries[backend].push_back(file);
+            }
+        }
+        std::sort(m_binaries[backend].begin(), m_binaries[backend].end());
+    }
+    return true;
+}
+
+inline bool RprUsdPrecompiledKernelResolver::IsFeatureDefine(std::string const& define, const char* featureDefine) {
+    // Defines come with or without a value, e.g. "THN_ENABLE_VOLUME" and "ENABLE_MATX=1"
+    return define.compare(0, define.find('='), featureDefine) == 0;
+}
+
+inline bool RprUsdPrecompiledKernelResolver::IsFeatureEnabled(std::string const& define, RprUsdKernelFeatures const& features, bool* isFeature) {
+    *isFeature = true;
+    if (IsFeatureDefine(define, "THN_ENABLE_VOLUME")) return features.volumes;
+    if (IsFeatureDefine(define, "ENABLE_MATX")) return features.materialX;
+    if (IsFeatureDefine(define, "ENABLE_MOTION_BLUR")) return features.motionBlur;
+    *isFeature = false;
+    return false;
+}
+
+inline bool RprUsdPrecompiledKernelResolver::IsUsed(Kernel const& kernel, RprUsdKernelFeatures const& features) {
+    if (TfStringContains(kernel.name, "Contour")) {
+        return features.contours;
+    }
+    if (TfStringContains(kernel.name, "Curve")) {
+        return features.curves;
+    }
+    return true;
+}
+
+inline std::vector<std::string> RprUsdPrecompiledKernelResolver::GetDefines(Kernel const& kernel, RprUsdKernelFeatures const& features) {
+    auto defines = kernel.alwaysDefines;
+    for (auto& define : kernel.optionalDefines) {
+        bool isFeature;
+        bool isEnabled = IsFeatureEnabled(define, features, &isFeature);
+        // Optional defines not driven by scene features (e.g. WG_SIZE) are chosen by RPR itself
+        if (!isFeature || isEnabled) {
+            defines.push_back(define);
+        }
+    }
+    std::sort(defines.begin(), defines.end());
+    return defines;
+}
+
+inline std::vector<RprUsdPrecompiledKernelResolver::Kernel const*> RprUsdPrecompiledKernelResolver::GetUsedKernels(RprUsdKernelFeatures const& features) const {
+    std::vector<Kernel const*> kernels;
+    for (auto& kernel : m_kernels) {
+        if (IsUsed(kernel, features)) {
+            kernels.push_back(&kernel);
+        }
+    }
+    return kernels;
+}
+
+inline std::vector<std::string> RprUsdPrecompiledKernelResolver::GetBinaries(RprUsdKernelFeatures const& features, Backend backend) const {
+    std::vector<std::string> binaries;
+    auto& allBinaries = m_binaries[backend];
+    for (auto kernel : GetUsedKernels(features)) {
+        auto prefix = GetBinaryPrefix(*kernel);
+        for (auto it = std::lower_bound(allBinaries.begin(), allBinaries.end(), prefix);
+             it != allBinaries.end() && TfStringStartsWith(*it, prefix); ++it) {
+            binaries.push_back(TfStringCatPaths(m_directory, *it));
+        }
+    }
+    // Kernels with several manifest entries (e.g. "LpeRegex#1", "LpeRegex#2") share binaries
+    std::sort(binaries.begin(), binaries.end());
+    binaries.erase(std::unique(binaries.begin(), binaries.end()), binaries.end());
+    return binaries;
+}
+
+inline bool RprUsdPrecompiledKernelResolver::Validate(RprUsdKernelFeatures const& features, Backend backend, std::vector<std::string>* missingKernels) const {
+    bool isValid = true;
+    auto& allBinaries = m_binaries[backend];
+    for (auto kernel : GetUsedKernels(features)) {
+        auto prefix = GetBinaryPrefix(*kernel);
+
+        bool hasBinary = false;
+        for (auto it = std::lower_bound(allBinaries.begin(), allBinaries.end(), prefix);
+             it != allBinaries.end() && TfStringStartsWith(*it, prefix) && !hasBinary; ++it) {
+            hasBinary = ArchGetFileLength(TfStringCatPaths(m_directory, *it).c_str()) > 0;
+        }
+
+        if (!hasBinary) {
+            isValid = false;
+            if (missingKernels) {
+                missingKernels->push_back(kernel->name);
+            }
+        }
+    }
+    return isValid;
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_KERNEL_RESOLVER_H
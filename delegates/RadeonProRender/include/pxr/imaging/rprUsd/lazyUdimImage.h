@@ -0,0 +1,330 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_LAZY_UDIM_IMAGE_H
+#define PXR_IMAGING_RPR_USD_LAZY_UDIM_IMAGE_H
+
+#include "pxr/imaging/rprUsd/coreImage.h"
+#include "pxr/imaging/rprUsd/error.h"
+#include "pxr/imaging/rprUsd/textureDiskCache.h"
+#include "pxr/imaging/rprUsd/textureDataPool.h"
+#include "pxr/imaging/rprUsd/util.h"
+#include "pxr/base/gf/range2f.h"
+#include "pxr/base/tf/fileUtils.h"
+#include "pxr/base/tf/stringUtils.h"
+#include "pxr/base/work/loops.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdLazyUDIMImage
+///
+/// UDIM image whose tiles are decoded and uploaded on first request only.
+/// Tiles are registered by id up front, RequestTile marks them as needed and
+/// Commit decodes all newly requested tiles in parallel and attaches them to
+/// the root image on the calling thread, which must own the rpr::Context.
+///
+/// Tiles that are registered but not resident yet are bound to a proxy: the
+/// coarsest cached mip level from RprUsdTextureDiskCache when one is available
+/// without decoding, otherwise a shared 1x1 mid-grey texel.
+///
+class RprUsdLazyUDIMImage {
+public:
+    static constexpr uint32_t kStartTile = 1001;
+    static constexpr uint32_t kEndTile = 1100;
+
+    /// UDIM tile id that covers \p uv
+    static uint32_t GetTileId(float u, float v) {
+        int iu = std::min(std::max(int(std::floor(u)), 0), 9);
+        int iv = std::max(int(std::floor(v)), 0);
+        return kStartTile + uint32_t(iu + iv * 10);
+    }
+
+    /// Registers all tiles of UDIM \p filepath that exist on disk, nothing is decoded yet
+    RprUsdLazyUDIMImage(
+        rpr::Context* context,
+        std::string const& filepath,
+        std::string const& colorspace,
+        rpr::ImageWrapType wrapType,
+        uint32_t numComponentsRequired,
+        RprUsdTextureDiskCache const* diskCache = nullptr);
+
+    void RegisterTile(uint32_t id, std::string filepath);
+
+    void RequestTile(uint32_t id);
+
+    /// Requests all tiles overlapped by \p uvRange
+    void RequestTiles(GfRange2f const& uvRange);
+
+    /// Decodes requested tiles and uploads them, returns the number of tiles that became resident
+    size_t Commit();
+
+    /// Root UDIM image, null until the first Commit
+    std::shared_ptr<RprUsdCoreImage> GetImage() const { return m_rootImage; }
+
+    bool IsTileResident(uint32_t id) const;
+    size_t GetNumRegisteredTiles() const { return m_tiles.size(); }
+    size_t GetNumResidentTiles() const;
+
+private:
+    struct Tile {
+        std::string filepath;
+        bool isRequested = false;
+        bool isResident = false;
+        bool hasProxy = false;
+        std::shared_ptr<RprUsdTextureData> data;
+    };
+
+    // Images referenced by the root image, shared with the root image deleter so that
+    // they outlive the root no matter who releases it last
+    struct TileImages {
+        std::map<uint32_t, std::unique_ptr<RprUsdCoreImage>> images;
+        std::unique_ptr<RprUsdCoreImage> defaultProxy;
+    };
+
+    bool CreateRootImage(std::vector<uint32_t> const& tileIds);
+    void AttachTile(uint32_t id, std::unique_ptr<RprUsdCoreImage> image, float gamma);
+    void AttachProxies();
+
+private:
+    rpr::Context* m_context;
+    std::string m_colorspace;
+    rpr::ImageWrapType m_wrapType;
+    uint32_t m_numComponentsRequired;
+    RprUsdTextureDiskCache const* m_diskCache;
+
+    std::map<uint32_t, Tile> m_tiles;
+    std::shared_ptr<TileImages> m_tileImages;
+    std::shared_ptr<RprUsdCoreImage> m_rootImage;
+};
+
+inline RprUsdLazyUDIMImage::RprUsdLazyUDIMImage(
+    rpr::Context* context,
+    std::string const& filepath,
+    std::string const& colorspace,
+    rpr::ImageWrapType wrapType,
+    uint32_t numComponentsRequired,
+    RprUsdTextureDiskCache const* diskCache)
+    : m_context(context)
+    , m_colorspace(colorspace)
+    , m_wrapType(wrapType)
+    , m_numComponentsRequired(numComponentsRequired)
+    , m_diskCache(diskCache)
+    , m_tileImages(std::make_shared<TileImages>()) {
+    std::string formatString;
+    if (!RprUsdGetUDIMFormatString(filepath, &formatString)) {
+        TF_CODING_ERROR("%s is not a UDIM filepath", filepath.c_str());
+        return;
+    }
+
+    for (uint32_t tileId = kStartTile; tileId <= kEndTile; ++tileId) {
+        auto tilePath = TfStringPrintf(formatString.c_str(), tileId);
+        if (TfIsFile(tilePath)) {
+            RegisterTile(tileId, std::move(tilePath));
+        }
+    }
+}
+
+inline void RprUsdLazyUDIMImage::RegisterTile(uint32_t id, std::string filepath) {
+    auto& tile = m_tiles[id];
+    tile.filepath = std::move(filepath);
+}
+
+inline void RprUsdLazyUDIMImage::RequestTile(uint32_t id) {
+    auto it = m_tiles.find(id);
+    if (it != m_tiles.end()) {
+        it->second.isRequested = true;
+    }
+}
+
+inline void RprUsdLazyUDIMImage::RequestTiles(GfRange2f const& uvRange) {
+    if (uvRange.IsEmpty()) {
+        return;
+    }
+
+    auto& min = uvRange.GetMin();
+    auto& max = uvRange.GetMax();
+    for (float v = std::floor(min[1]); v <= max[1]; v += 1.0f) {
+        for (float u = std::floor(min[0]); u <= max[0] && u < 10.0f; u += 1.0f) {
+            RequestTile(GetTileId(u, v));
+        }
+    }
+}
+
+inline bool RprUsdLazyUDIMImage::IsTileResident(uint32_t id) const {
+    auto it = m_tiles.find(id);
+    return it != m_tiles.end() && it->second.isResident;
+}
+
+inline size_t RprUsdLazyUDIMImage::GetNumResidentTiles() const {
+    size_t numResidentTiles = 0;
+    for (auto& entry : m_tiles) {
+        numResidentTiles += entry.second.isResident ? 1 : 0;
+    }
+    return numResidentTiles;
+}
+
+inline size_t RprUsdLazyUDIMImage::Commit() {
+    if (m_tiles.empty()) {
+        return 0;
+    }
+
+    // Root image can not be created without at least one real tile
+    if (!m_rootImage && std::none_of(m_tiles.begin(), m_tiles.end(), [](auto& entry) { return entry.second.isRequested; })) {
+        m_tiles.begin()->second.isRequested = true;
+    }
+
+    std::vector<std::pair<uint32_t, Tile*>> tilesToLoad;
+    for (auto& entry : m_tiles) {
+        if (entry.second.isRequested && !entry.second.isResident) {
+            tilesToLoad.emplace_back(entry.first, &entry.second);
+        }
+    }
+    if (tilesToLoad.empty()) {
+        return 0;
+    }
+
+    WorkParallelForN(tilesToLoad.size(),
+        [&tilesToLoad](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                auto tile = tilesToLoad[i].second;
+                tile->data = RprUsdTextureDataPool::GetInstance().Get(tile->filepath);
+                if (!tile->data) {
+                    TF_RUNTIME_ERROR("Failed to load %s", tile->filepath.c_str());
+                }
+            }
+        }
+    );
+
+    size_t numLoadedTiles = 0;
+    if (!m_rootImage) {
+        std::vector<uint32_t> tileIds;
+        for (auto& entry : tilesToLoad) {
+            tileIds.push_back(entry.first);
+        }
+        if (!CreateRootImage(tileIds)) {
+            return 0;
+        }
+        for (auto& entry : tilesToLoad) {
+            if (entry.second->data) {
+                entry.second->isResident = true;
+                ++numLoadedTiles;
+            }
+        }
+        AttachProxies();
+    } else {
+        for (auto& entry : tilesToLoad) {
+            auto tile = entry.second;
+            if (!tile->data) {
+                continue;
+            }
+
+            // Zero tile id makes RprUsdCoreImage create a regular image
+            std::vector<RprUsdCoreImage::UDIMTile> tileData{{0, tile->data.get()}};
+            std::unique_ptr<RprUsdCoreImage> tileImage(RprUsdCoreImage::Create(m_context, tileData, m_numComponentsRequired));
+            if (tileImage) {
+                float gamma = RprUsdGetImageGamma(m_colorspace, tileImage->GetFormat());
+                AttachTile(entry.first, std::move(tileImage), gamma);
+                tile->isResident = true;
+                ++numLoadedTiles;
+            }
+        }
+    }
+
+    for (auto& entry : tilesToLoad) {
+        // Tile data is copied by RPR on image creation
+        entry.second->data = nullptr;
+    }
+
+    return numLoadedTiles;
+}
+
+inline bool RprUsdLazyUDIMImage::CreateRootImage(std::vector<uint32_t> const& tileIds) {
+    std::vector<RprUsdCoreImage::UDIMTile> tileData;
+    for (auto id : tileIds) {
+        if (auto& data = m_tiles[id].data) {
+            tileData.emplace_back(id, data.get());
+        }
+    }
+    if (tileData.empty()) {
+        return false;
+    }
+
+    auto rootImage = RprUsdCoreImage::Create(m_context, tileData, m_numComponentsRequired);
+    if (!rootImage) {
+        return false;
+    }
+    rootImage->SetWrap(m_wrapType);
+    rootImage->SetGamma(RprUsdGetImageGamma(m_colorspace, rootImage->GetFormat()));
+
+    auto tileImages = m_tileImages;
+    m_rootImage = std::shared_ptr<RprUsdCoreImage>(rootImage,
+        [tileImages](RprUsdCoreImage* image) {
+            delete image;
+        }
+    );
+    return true;
+}
+
+inline void RprUsdLazyUDIMImage::AttachTile(uint32_t id, std::unique_ptr<RprUsdCoreImage> image, float gamma) {
+    image->SetGamma(gamma);
+    if (!RPR_ERROR_CHECK(m_rootImage->GetRootImage()->SetUDIM(id, image->GetRootImage()), "Failed to set UDIM tile")) {
+        m_tileImages->images[id] = std::move(image);
+    }
+}
+
+inline void RprUsdLazyUDIMImage::AttachProxies() {
+    for (auto& entry : m_tiles) {
+        auto& tile = entry.second;
+        if (tile.isResident || tile.hasProxy) {
+            continue;
+        }
+
+        std::unique_ptr<RprUsdCoreImage> proxyImage;
+        float proxyGamma = 1.0f;
+        if (m_diskCache) {
+            if (auto mappedTexture = m_diskCache->Find(tile.filepath, m_colorspace, m_numComponentsRequired)) {
+                auto level = mappedTexture->GetLevel(mappedTexture->GetNumLevels() - 1);
+                proxyImage.reset(RprUsdCoreImage::Create(m_context, level.width, level.height, mappedTexture->GetFormat(), level.data));
+                // Stored format might be narrower than the one of the tile loaded later
+                proxyGamma = mappedTexture->GetGamma();
+            }
+        }
+
+        if (proxyImage) {
+            AttachTile(entry.first, std::move(proxyImage), proxyGamma);
+        } else {
+            if (!m_tileImages->defaultProxy) {
+                const uint8_t kProxyTexel[4] = {128, 128, 128, 255};
+                m_tileImages->defaultProxy.reset(RprUsdCoreImage::Create(m_context, 1, 1, {4, RPR_COMPONENT_TYPE_UINT8}, kProxyTexel));
+                if (!m_tileImages->defaultProxy) {
+                    return;
+                }
+            }
+            if (RPR_ERROR_CHECK(m_rootImage->GetRootImage()->SetUDIM(entry.first, m_tileImages->defaultProxy->GetRootImage()), "Failed to set UDIM proxy tile")) {
+                continue;
+            }
+        }
+        tile.hasProxy = true;
+    }
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_LAZY_UDIM_IMAGE_H
@@ -0,0 +1,310 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_MATERIAL_CACHE_H
+#define PXR_IMAGING_RPR_USD_MATERIAL_CACHE_H
+
+#include "pxr/imaging/rprUsd/material.h"
+#include "pxr/imaging/rprUsd/materialNetworkHash.h"
+#include "pxr/imaging/rprUsd/materialNetworkOptimizer.h"
+#include "pxr/imaging/rprUsd/materialPrewarm.h"
+#include "pxr/imaging/rprUsd/materialRegistry.h"
+#include "pxr/imaging/rprUsd/tokens.h"
+#include "pxr/imaging/hd/sceneDelegate.h"
+#include "pxr/base/tf/getenv.h"
+#include "pxr/base/work/loops.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdMaterialCache
+///
+/// Shares compiled materials between material prims whose networks are
+/// structurally equal, see RprUsdCanonicalMaterialNetwork. Materials are
+/// created with RprUsdMaterialRegistry::CreateMaterial on first use and are
+/// reference counted: a shared material lives as long as any prim uses it.
+///
+/// CreateMaterial also reads the RprUsdMaterialSettingsAPI attributes of the
+/// material prim (rpr:material:id and rpr:material:assetName), so they are part
+/// of the key: prims with different material IDs or cryptomatte asset names
+/// never share a material.
+///
+/// With RPRUSD_MATERIAL_OPTIMIZE=1, networks are simplified with
+/// RprUsdOptimizeMaterialNetwork before they are hashed and translated. It is
+/// off by default until the rewrites are validated against reference renders.
+///
+/// GetMaterials translates many materials at once, e.g. on initial sync: network
+/// conversion and canonicalization run in parallel, while materials are created
+/// serially because rpr::Context calls are not thread-safe. Concurrent GetMaterial
+/// calls are serialized too, so an equal material is never created twice.
+///
+/// When a RprUsdPrewarmManifest is set, every requested network is recorded in
+/// it, so that the next session can prewarm its textures and nodedefs.
+///
+/// One cache serves one rpr::Context with fixed hybrid settings.
+///
+class RprUsdMaterialCache {
+public:
+    struct Stats {
+        size_t numRequests = 0;
+        size_t numSharedRequests = 0;
+        size_t numCreatedMaterials = 0;
+        size_t numLiveMaterials = 0;
+        RprUsdMaterialNetworkOptimizerStats optimizerStats;
+    };
+
+    struct MaterialRequest {
+        SdfPath materialId;
+        HdSceneDelegate* sceneDelegate;
+        HdMaterialNetworkMap const* networkMap;
+    };
+
+    RprUsdMaterialCache(
+        rpr::Context* rprContext,
+        RprUsdImageCache* imageCache,
+        bool isHybrid,
+        bool hybridEnableDisplacement)
+        : m_rprContext(rprContext)
+        , m_imageCache(imageCache)
+        , m_isHybrid(isHybrid)
+        , m_hybridEnableDisplacement(hybridEnableDisplacement)
+        , m_optimizeNetworks(TfGetenvBool("RPRUSD_MATERIAL_OPTIMIZE", false)) {}
+
+    RprUsdMaterialCache(RprUsdMaterialCache const&) = delete;
+    RprUsdMaterialCache& operator=(RprUsdMaterialCache const&) = delete;
+
+    /// Returns a material for \p networkMap, shared with all materials of equal structure
+    std::shared_ptr<RprUsdMaterial> GetMaterial(
+        SdfPath const& materialId,
+        HdSceneDelegate* sceneDelegate,
+        HdMaterialNetworkMap const& networkMap);
+
+    /// Batched GetMaterial, the result has a material (or nullptr) for each of \p requests
+    std::vector<std::shared_ptr<RprUsdMaterial>> GetMaterials(std::vector<MaterialRequest> const& requests);
+
+    /// Records all networks requested from now on into \p manifest, nullptr stops recording.
+    /// \p manifest must outlive the cache or be reset before it's destroyed.
+    void SetPrewarmManifest(RprUsdPrewarmManifest* manifest) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_prewarmManifest = manifest;
+    }
+
+    Stats GetStats() const;
+
+private:
+    // Per-prim attributes CreateMaterial reads besides the network
+    struct Settings {
+        int id = 0;
+        std::string assetName;
+
+        bool operator==(Settings const& rhs) const { return id == rhs.id && assetName == rhs.assetName; }
+    };
+
+    struct Entry {
+        RprUsdCanonicalMaterialNetwork network;
+        Settings settings;
+        std::weak_ptr<RprUsdMaterial> material;
+    };
+
+    struct PreparedNetwork {
+        RprUsdCanonicalMaterialNetwork canonicalNetwork;
+        HdMaterialNetworkMap optimizedNetworkMap;
+        bool isOptimized = false;
+        RprUsdMaterialNetworkOptimizerStats optimizerStats;
+    };
+
+    void Prepare(HdMaterialNetworkMap const& networkMap, PreparedNetwork* prepared) const;
+
+    std::shared_ptr<RprUsdMaterial> GetMaterial(
+        SdfPath const& materialId,
+        HdSceneDelegate* sceneDelegate,
+        HdMaterialNetworkMap const& networkMap,
+        PreparedNetwork prepared);
+
+    static Settings GetSettings(SdfPath const& materialId, HdSceneDelegate* sceneDelegate);
+    static uint64_t GetHash(RprUsdCanonicalMaterialNetwork const& network, Settings const& settings);
+
+    std::shared_ptr<RprUsdMaterial> Find(RprUsdCanonicalMaterialNetwork const& network, Settings const& settings);
+    void PruneExpired();
+
+private:
+    rpr::Context* m_rprContext;
+    RprUsdImageCache* m_imageCache;
+    bool m_isHybrid;
+    bool m_hybridEnableDisplacement;
+    bool m_optimizeNetworks;
+
+    // Held from lookup to insertion of a material, taken before m_mutex
+    std::mutex m_creationMutex;
+
+    mutable std::mutex m_mutex;
+    std::unordered_multimap<uint64_t, Entry> m_entries;
+    size_t m_pruneThreshold = 64;
+    RprUsdPrewarmManifest* m_prewarmManifest = nullptr;
+
+    size_t m_numRequests = 0;
+    size_t m_numSharedRequests = 0;
+    size_t m_numCreatedMaterials = 0;
+    RprUsdMaterialNetworkOptimizerStats m_optimizerStats;
+};
+
+inline void RprUsdMaterialCache::Prepare(HdMaterialNetworkMap const& networkMap, PreparedNetwork* prepared) const {
+    RprUsd_MaterialNetwork network;
+    RprUsd_MaterialNetworkFromHdMaterialNetworkMap(networkMap, network);
+
+    if (m_optimizeNetworks && RprUsdOptimizeMaterialNetwork(&network, &prepared->optimizerStats)) {
+        RprUsdMaterialNetworkToHdMaterialNetworkMap(network, networkMap, &prepared->optimizedNetworkMap);
+        prepared->isOptimized = true;
+    }
+    prepared->canonicalNetwork = RprUsdCanonicalMaterialNetwork(network);
+}
+
+inline RprUsdMaterialCache::Settings RprUsdMaterialCache::GetSettings(SdfPath const& materialId, HdSceneDelegate* sceneDelegate) {
+    Settings settings;
+    if (!sceneDelegate) {
+        return settings;
+    }
+
+    auto id = sceneDelegate->Get(materialId, RprUsdTokens->rprMaterialId);
+    if (id.IsHolding<int>()) {
+        settings.id = id.UncheckedGet<int>();
+    }
+    auto assetName = sceneDelegate->Get(materialId, RprUsdTokens->rprMaterialAssetName);
+    if (assetName.IsHolding<std::string>()) {
+        settings.assetName = assetName.UncheckedGet<std::string>();
+    }
+    return settings;
+}
+
+inline uint64_t RprUsdMaterialCache::GetHash(RprUsdCanonicalMaterialNetwork const& network, Settings const& settings) {
+    uint64_t hash = network.GetHash();
+    hash ^= std::hash<int>{}(settings.id) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    hash ^= std::hash<std::string>{}(settings.assetName) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    return hash;
+}
+
+inline std::shared_ptr<RprUsdMaterial> RprUsdMaterialCache::Find(RprUsdCanonicalMaterialNetwork const& network, Settings const& settings) {
+    auto range = m_entries.equal_range(GetHash(network, settings));
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second.network == network && it->second.settings == settings) {
+            if (auto material = it->second.material.lock()) {
+                return material;
+            }
+        }
+    }
+    return nullptr;
+}
+
+inline void RprUsdMaterialCache::PruneExpired() {
+    if (m_entries.size() < m_pruneThreshold) {
+        return;
+    }
+    for (auto it = m_entries.begin(); it != m_entries.end();) {
+        if (it->second.material.expired()) {
+            it = m_entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    m_pruneThreshold = std::max<size_t>(64, m_entries.size() * 2);
+}
+
+inline std::shared_ptr<RprUsdMaterial> RprUsdMaterialCache::GetMaterial(
+    SdfPath const& materialId,
+    HdSceneDelegate* sceneDelegate,
+    HdMaterialNetworkMap const& networkMap) {
+    PreparedNetwork prepared;
+    Prepare(networkMap, &prepared);
+    return GetMaterial(materialId, sceneDelegate, networkMap, std::move(prepared));
+}
+
+inline std::vector<std::shared_ptr<RprUsdMaterial>> RprUsdMaterialCache::GetMaterials(std::vector<MaterialRequest> const& requests) {
+    std::vector<PreparedNetwork> preparedNetworks(requests.size());
+    WorkParallelForN(requests.size(),
+        [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                Prepare(*requests[i].networkMap, &preparedNetworks[i]);
+            }
+        }
+    );
+
+    // Equal networks within the batch are created once, later requests hit the cache
+    std::vector<std::shared_ptr<RprUsdMaterial>> materials(requests.size());
+    for (size_t i = 0; i < requests.size(); ++i) {
+        auto& request = requests[i];
+        materials[i] = GetMaterial(request.materialId, request.sceneDelegate, *request.networkMap, std::move(preparedNetworks[i]));
+    }
+    return materials;
+}
+
+inline std::shared_ptr<RprUsdMaterial> RprUsdMaterialCache::GetMaterial(
+    SdfPath const& materialId,
+    HdSceneDelegate* sceneDelegate,
+    HdMaterialNetworkMap const& networkMap,
+    PreparedNetwork prepared) {
+    std::lock_guard<std::mutex> creationLock(m_creationMutex);
+
+    auto& canonicalNetwork = prepared.canonicalNetwork;
+    auto settings = GetSettings(materialId, sceneDelegate);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_numRequests;
+        m_optimizerStats.numRemovedNodes += prepared.optimizerStats.numRemovedNodes;
+        m_optimizerStats.numFoldedConstants += prepared.optimizerStats.numFoldedConstants;
+        m_optimizerStats.numCollapsedBlends += prepared.optimizerStats.numCollapsedBlends;
+        if (m_prewarmManifest) {
+            m_prewarmManifest->AddMaterialNetwork(canonicalNetwork);
+        }
+
+        if (auto material = Find(canonicalNetwork, settings)) {
+            ++m_numSharedRequests;
+            return material;
+        }
+    }
+
+    std::shared_ptr<RprUsdMaterial> material(RprUsdMaterialRegistry::GetInstance().CreateMaterial(
+        materialId, sceneDelegate, prepared.isOptimized ? prepared.optimizedNetworkMap : networkMap, m_rprContext, m_imageCache, m_isHybrid, m_hybridEnableDisplacement));
+    if (!material) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    PruneExpired();
+    ++m_numCreatedMaterials;
+    auto hash = GetHash(canonicalNetwork, settings);
+    m_entries.emplace(hash, Entry{std::move(canonicalNetwork), std::move(settings), material});
+    return material;
+}
+
+inline RprUsdMaterialCache::Stats RprUsdMaterialCache::GetStats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats stats;
+    stats.numRequests = m_numRequests;
+    stats.numSharedRequests = m_numSharedRequests;
+    stats.numCreatedMaterials = m_numCreatedMaterials;
+    stats.optimizerStats = m_optimizerStats;
+    for (auto& entry : m_entries) {
+        if (!entry.second.material.expired()) {
+            ++stats.numLiveMaterials;
+        }
+    }
+    return stats;
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_MATERIAL_CACHE_H
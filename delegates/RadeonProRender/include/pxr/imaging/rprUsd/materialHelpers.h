@@ -21,6 +21,7 @@ limitations under the License.
 #include "pxr/imaging/rprUsd/error.h"
 
 #include <memory>
+#include <vector>
 
 PXR_NAMESPACE_OPEN_SCOPE
 
@@ -35,6 +36,131 @@ inline rpr_uint TranslateEmumValue(rpr::MaterialNodeInput input, int value) {
     }
 }
 
+/// \class RprUsdMaterialInputValue
+///
+/// Value of an rpr::MaterialNode input resolved to the form RPR takes, so that
+/// code which sets the input later (e.g. RprUsdCommandQueue) applies it with a
+/// plain switch over the few RPR input kinds instead of a chain of VtValue type
+/// checks. SetRprInput still dispatches on the VtValue directly.
+///
+class RprUsdMaterialInputValue {
+public:
+    enum Type {
+        kUInt,
+        kFloat4,
+        kNode,
+        kImage,
+    };
+
+    RprUsdMaterialInputValue() : RprUsdMaterialInputValue(0u) {}
+    RprUsdMaterialInputValue(rpr_uint value) : m_type(kUInt) { m_uint = value; }
+    RprUsdMaterialInputValue(float x, float y, float z, float w) : m_type(kFloat4) {
+        m_float4[0] = x; m_float4[1] = y; m_float4[2] = z; m_float4[3] = w;
+    }
+    RprUsdMaterialInputValue(rpr::MaterialNode* node) : m_type(kNode) { m_node = node; }
+    RprUsdMaterialInputValue(rpr::Image* image) : m_type(kImage) { m_image = image; }
+
+    /// Resolves \p value for \p input, returns false if the VtValue type is not supported.
+    /// RprMaterialNodePtr values are stored as raw pointers, the caller keeps the node alive.
+    static bool FromVtValue(rpr::MaterialNodeInput input, VtValue const& value, RprUsdMaterialInputValue* out);
+
+    Type GetType() const { return m_type; }
+
+    rpr::Status Apply(rpr::MaterialNode* node, rpr::MaterialNodeInput input) const {
+        switch (m_type) {
+            case kUInt: return node->SetInput(input, m_uint);
+            case kFloat4: return node->SetInput(input, m_float4[0], m_float4[1], m_float4[2], m_float4[3]);
+            case kNode: return node->SetInput(input, m_node);
+            case kImage: return node->SetInput(input, m_image);
+        }
+        return RPR_ERROR_INVALID_PARAMETER_TYPE;
+    }
+
+private:
+    Type m_type;
+    union {
+        rpr_uint m_uint;
+        float m_float4[4];
+        rpr::MaterialNode* m_node;
+        rpr::Image* m_image;
+    };
+};
+
+inline bool RprUsdMaterialInputValue::FromVtValue(rpr::MaterialNodeInput input, VtValue const& value, RprUsdMaterialInputValue* out) {
+    if (value.IsHolding<uint32_t>()) {
+        *out = RprUsdMaterialInputValue(rpr_uint(value.UncheckedGet<uint32_t>()));
+    } else if (value.IsHolding<int>()) {
+        *out = RprUsdMaterialInputValue(TranslateEmumValue(input, value.UncheckedGet<int>()));
+    } else if (value.IsHolding<bool>()) {
+        *out = RprUsdMaterialInputValue(rpr_uint(value.UncheckedGet<bool>() ? 1 : 0));
+    } else if (value.IsHolding<float>()) {
+        auto v = value.UncheckedGet<float>();
+        *out = RprUsdMaterialInputValue(v, v, v, v);
+    } else if (value.IsHolding<GfVec3f>()) {
+        auto& v = value.UncheckedGet<GfVec3f>();
+        *out = RprUsdMaterialInputValue(v[0], v[1], v[2], 1.0f);
+    } else if (value.IsHolding<GfVec2f>()) {
+        auto& v = value.UncheckedGet<GfVec2f>();
+        *out = RprUsdMaterialInputValue(v[0], v[1], 1.0f, 1.0f);
+    } else if (value.IsHolding<GfVec4f>()) {
+        auto& v = value.UncheckedGet<GfVec4f>();
+        *out = RprUsdMaterialInputValue(v[0], v[1], v[2], v[3]);
+    } else if (value.IsHolding<RprMaterialNodePtr>()) {
+        *out = RprUsdMaterialInputValue(value.UncheckedGet<RprMaterialNodePtr>().get());
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/// \class RprUsdMaterialInputBatch
+///
+/// Inputs of one rpr::MaterialNode collected during translation and set together.
+///
+class RprUsdMaterialInputBatch {
+public:
+    void Add(rpr::MaterialNodeInput input, RprUsdMaterialInputValue const& value) {
+        m_inputs.push_back({input, value});
+    }
+
+    /// Returns false if \p value has unsupported type, nothing is added then
+    bool Add(rpr::MaterialNodeInput input, VtValue const& value) {
+        RprUsdMaterialInputValue inputValue;
+        if (!RprUsdMaterialInputValue::FromVtValue(input, value, &inputValue)) {
+            TF_RUNTIME_ERROR("Failed to set material input %d: unsupported VtValue type - %s", input, value.GetTypeName().c_str());
+            return false;
+        }
+        Add(input, inputValue);
+        return true;
+    }
+
+    size_t GetSize() const { return m_inputs.size(); }
+    void Clear() { m_inputs.clear(); }
+
+    /// Sets all inputs on \p node, returns the first error
+    rpr::Status Apply(rpr::MaterialNode* node) const {
+        rpr::Status result = RPR_SUCCESS;
+        for (auto& entry : m_inputs) {
+            auto status = entry.value.Apply(node, entry.input);
+            if (status != RPR_SUCCESS) {
+                auto errMsg = TfStringPrintf("Failed to set material input %d", entry.input);
+                RPR_ERROR_CHECK(status, errMsg.c_str());
+                if (result == RPR_SUCCESS) {
+                    result = status;
+                }
+            }
+        }
+        return result;
+    }
+
+private:
+    struct Entry {
+        rpr::MaterialNodeInput input;
+        RprUsdMaterialInputValue value;
+    };
+    std::vector<Entry> m_inputs;
+};
+
 inline rpr::Status SetRprInput(rpr::MaterialNode* node, rpr::MaterialNodeInput input, VtValue const& value) {
     rpr::Status status;
     if (value.IsHolding<uint32_t>()) {
@@ -73,12 +199,12 @@ inline rpr::Status SetRprInput(rpr::MaterialNode* node, rpr::MaterialNodeInput i
 
 inline GfVec4f GetRprFloat(VtValue const& value) {
     if (value.IsHolding<int>()) {
-        return GfVec4f(value.Get<int>());
+        return GfVec4f(value.UncheckedGet<int>());
     } else if (value.IsHolding<GfVec3f>()) {
-        GfVec3f v = value.Get<GfVec3f>();
+        auto& v = value.UncheckedGet<GfVec3f>();
         return GfVec4f(v[0], v[1], v[2], 1.0f);
     } if (value.IsHolding<float>()) {
-        return GfVec4f(value.Get<float>());
+        return GfVec4f(value.UncheckedGet<float>());
     } else {
         return value.Get<GfVec4f>();
     }
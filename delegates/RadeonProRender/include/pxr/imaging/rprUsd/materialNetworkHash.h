@@ -0,0 +1,215 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_MATERIAL_NETWORK_HASH_H
+#define PXR_IMAGING_RPR_USD_MATERIAL_NETWORK_HASH_H
+
+#include "pxr/imaging/rprUsd/materialRegistry.h"
+#include "pxr/base/arch/hash.h"
+#include "pxr/usd/sdf/assetPath.h"
+
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdCanonicalMaterialNetwork
+///
+/// Path independent form of RprUsd_MaterialNetwork. Nodes reachable from the
+/// terminals are numbered in depth-first order, starting from the terminals
+/// sorted by name and following input connections sorted by input name, so
+/// two networks that match node for node have equal canonical forms no matter
+/// where their nodes live in the scene. Nodes not reachable from any terminal
+/// do not affect the material and are dropped.
+///
+/// The hash covers node types, parameters, connections and terminals. Strings,
+/// tokens and asset paths are hashed by content, so hashes are stable between
+/// runs of the same build.
+///
+class RprUsdCanonicalMaterialNetwork {
+public:
+    static constexpr uint32_t kInvalidNode = std::numeric_limits<uint32_t>::max();
+
+    struct Connection {
+        uint32_t upstreamNode;
+        TfToken upstreamOutputName;
+
+        bool operator==(Connection const& rhs) const {
+            return upstreamNode == rhs.upstreamNode && upstreamOutputName == rhs.upstreamOutputName;
+        }
+    };
+
+    struct Node {
+        SdfPath path;
+        TfToken nodeTypeId;
+        std::map<TfToken, VtValue> parameters;
+        std::map<TfToken, std::vector<Connection>> inputConnections;
+    };
+
+    struct Terminal {
+        TfToken name;
+        Connection connection;
+
+        bool operator==(Terminal const& rhs) const {
+            return name == rhs.name && connection == rhs.connection;
+        }
+    };
+
+    RprUsdCanonicalMaterialNetwork() = default;
+    explicit RprUsdCanonicalMaterialNetwork(RprUsd_MaterialNetwork const& network);
+
+    std::vector<Node> const& GetNodes() const { return m_nodes; }
+    std::vector<Terminal> const& GetTerminals() const { return m_terminals; }
+
+    uint64_t GetHash() const { return m_hash; }
+
+    /// True if both networks have the same nodes, connections and terminals, parameters aside
+    bool HasSameTopology(RprUsdCanonicalMaterialNetwork const& rhs) const;
+
+    bool operator==(RprUsdCanonicalMaterialNetwork const& rhs) const;
+    bool operator!=(RprUsdCanonicalMaterialNetwork const& rhs) const { return !(*this == rhs); }
+
+    static uint64_t HashString(std::string const& str) {
+        return ArchHash64(str.c_str(), str.size());
+    }
+    static uint64_t HashParameter(VtValue const& value);
+
+private:
+    uint32_t Visit(RprUsd_MaterialNetwork const& network, SdfPath const& path, std::map<SdfPath, uint32_t>* indices);
+    void ComputeHash();
+
+    static void HashCombine(uint64_t* hash, uint64_t value) {
+        *hash ^= value + 0x9e3779b9 + (*hash << 6) + (*hash >> 2);
+    }
+
+private:
+    std::vector<Node> m_nodes;
+    std::vector<Terminal> m_terminals;
+    uint64_t m_hash = 0;
+};
+
+inline RprUsdCanonicalMaterialNetwork::RprUsdCanonicalMaterialNetwork(RprUsd_MaterialNetwork const& network) {
+    std::map<SdfPath, uint32_t> indices;
+    for (auto& entry : network.terminals) {
+        Terminal terminal;
+        terminal.name = entry.first;
+        terminal.connection.upstreamNode = Visit(network, entry.second.upstreamNode, &indices);
+        terminal.connection.upstreamOutputName = entry.second.upstreamOutputName;
+        m_terminals.push_back(std::move(terminal));
+    }
+    ComputeHash();
+}
+
+inline uint32_t RprUsdCanonicalMaterialNetwork::Visit(
+    RprUsd_MaterialNetwork const& network,
+    SdfPath const& path,
+    std::map<SdfPath, uint32_t>* indices) {
+    auto indexIt = indices->find(path);
+    if (indexIt != indices->end()) {
+        return indexIt->second;
+    }
+
+    auto nodeIt = network.nodes.find(path);
+    if (nodeIt == network.nodes.end()) {
+        return kInvalidNode;
+    }
+
+    // The index is assigned before visiting inputs so that malformed cyclic networks terminate
+    uint32_t index = uint32_t(m_nodes.size());
+    indices->emplace(path, index);
+    m_nodes.emplace_back();
+    m_nodes[index].path = path;
+    m_nodes[index].nodeTypeId = nodeIt->second.nodeTypeId;
+    m_nodes[index].parameters = nodeIt->second.parameters;
+
+    for (auto& input : nodeIt->second.inputConnections) {
+        std::vector<Connection> connections;
+        for (auto& connection : input.second) {
+            connections.push_back({Visit(network, connection.upstreamNode, indices), connection.upstreamOutputName});
+        }
+        // m_nodes may have been reallocated by the recursive calls
+        m_nodes[index].inputConnections.emplace(input.first, std::move(connections));
+    }
+
+    return index;
+}
+
+inline uint64_t RprUsdCanonicalMaterialNetwork::HashParameter(VtValue const& value) {
+    if (value.IsHolding<TfToken>()) {
+        return HashString(value.UncheckedGet<TfToken>().GetString());
+    } else if (value.IsHolding<std::string>()) {
+        return HashString(value.UncheckedGet<std::string>());
+    } else if (value.IsHolding<SdfAssetPath>()) {
+        auto& assetPath = value.UncheckedGet<SdfAssetPath>();
+        uint64_t hash = HashString(assetPath.GetAssetPath());
+        HashCombine(&hash, HashString(assetPath.GetResolvedPath()));
+        return hash;
+    }
+    return value.GetHash();
+}
+
+inline void RprUsdCanonicalMaterialNetwork::ComputeHash() {
+    uint64_t hash = m_nodes.size();
+    for (auto& node : m_nodes) {
+        HashCombine(&hash, HashString(node.nodeTypeId.GetString()));
+        for (auto& parameter : node.parameters) {
+            HashCombine(&hash, HashString(parameter.first.GetString()));
+            HashCombine(&hash, HashParameter(parameter.second));
+        }
+        for (auto& input : node.inputConnections) {
+            HashCombine(&hash, HashString(input.first.GetString()));
+            for (auto& connection : input.second) {
+                HashCombine(&hash, connection.upstreamNode);
+                HashCombine(&hash, HashString(connection.upstreamOutputName.GetString()));
+            }
+        }
+    }
+    for (auto& terminal : m_terminals) {
+        HashCombine(&hash, HashString(terminal.name.GetString()));
+        HashCombine(&hash, terminal.connection.upstreamNode);
+        HashCombine(&hash, HashString(terminal.connection.upstreamOutputName.GetString()));
+    }
+    m_hash = hash;
+}
+
+inline bool RprUsdCanonicalMaterialNetwork::HasSameTopology(RprUsdCanonicalMaterialNetwork const& rhs) const {
+    if (m_nodes.size() != rhs.m_nodes.size() || m_terminals != rhs.m_terminals) {
+        return false;
+    }
+    for (size_t i = 0; i < m_nodes.size(); ++i) {
+        if (m_nodes[i].nodeTypeId != rhs.m_nodes[i].nodeTypeId ||
+            m_nodes[i].inputConnections != rhs.m_nodes[i].inputConnections) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool RprUsdCanonicalMaterialNetwork::operator==(RprUsdCanonicalMaterialNetwork const& rhs) const {
+    if (m_hash != rhs.m_hash || !HasSameTopology(rhs)) {
+        return false;
+    }
+    for (size_t i = 0; i < m_nodes.size(); ++i) {
+        if (m_nodes[i].parameters != rhs.m_nodes[i].parameters) {
+            return false;
+        }
+    }
+    return true;
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_MATERIAL_NETWORK_HASH_H
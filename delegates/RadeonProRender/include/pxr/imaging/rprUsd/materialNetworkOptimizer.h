@@ -0,0 +1,364 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_MATERIAL_NETWORK_OPTIMIZER_H
+#define PXR_IMAGING_RPR_USD_MATERIAL_NETWORK_OPTIMIZER_H
+
+#include "pxr/imaging/rprUsd/materialRegistry.h"
+#include "pxr/base/gf/vec3f.h"
+
+#include <algorithm>
+#include <initializer_list>
+#include <map>
+#include <set>
+#include <vector>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+struct RprUsdMaterialNetworkOptimizerStats {
+    size_t numRemovedNodes = 0;
+    size_t numFoldedConstants = 0;
+    size_t numCollapsedBlends = 0;
+};
+
+/// Simplifies \p network before it is translated to RPR nodes:
+///   - rpr_blend_value nodes with constant inputs are folded into rpr_constant_texture
+///   - rpr_constant_texture nodes feeding rpr_blend_value colors become parameters
+///   - rpr_blend and rpr_blend_value nodes with a weight of 0 or 1 or with equal
+///     inputs are replaced by the selected input, rpr_blend only if it has no
+///     inputs other than color0, color1 and weight
+///   - nodes that do not feed any terminal are removed
+///
+/// Only nodes whose input types are known from their nodedefs are rewritten, other
+/// nodes (rpr_passthrough is an unlit shader rather than an identity) are kept as is.
+/// rpr_blend and rpr_blend_value are translated to RPR_MATERIAL_NODE_BLEND and
+/// RPR_MATERIAL_NODE_BLEND_VALUE, which the RPR SDK documents as a linear
+/// interpolation from color0 (weight 0) to color1 (weight 1): the output is
+/// color0 * (1 - weight) + color1 * weight. The nodedef docs in rpr_blend.mtlx
+/// and rpr_blend_value.mtlx state the same.
+///
+/// Returns true if the network was modified.
+inline bool RprUsdOptimizeMaterialNetwork(RprUsd_MaterialNetwork* network, RprUsdMaterialNetworkOptimizerStats* stats = nullptr);
+
+/// Builds an HdMaterialNetworkMap from \p network, e.g. to create a material from
+/// an optimized network. Primvars are taken from \p sourceNetworkMap.
+inline void RprUsdMaterialNetworkToHdMaterialNetworkMap(
+    RprUsd_MaterialNetwork const& network,
+    HdMaterialNetworkMap const& sourceNetworkMap,
+    HdMaterialNetworkMap* result);
+
+namespace RprUsd_MaterialNetworkOptimizer {
+
+struct Tokens {
+    TfToken blend{"rpr_blend"};
+    TfToken blendValue{"rpr_blend_value"};
+    TfToken constantTexture{"rpr_constant_texture"};
+    TfToken weight{"weight"};
+    TfToken color0{"color0"};
+    TfToken color1{"color1"};
+    TfToken value{"value"};
+};
+
+inline Tokens const& GetTokens() {
+    static Tokens tokens;
+    return tokens;
+}
+
+/// True if \p node has an authored or connected input not listed in \p inputs
+template <typename Node>
+bool HasOtherInputs(Node const& node, std::initializer_list<TfToken> inputs) {
+    auto isListed = [&inputs](TfToken const& name) {
+        return std::find(inputs.begin(), inputs.end(), name) != inputs.end();
+    };
+    for (auto& parameter : node.parameters) {
+        if (!isListed(parameter.first)) {
+            return true;
+        }
+    }
+    for (auto& input : node.inputConnections) {
+        if (!isListed(input.first)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Post-order of the nodes reachable from the terminals, upstream nodes first
+inline void CollectReachable(
+    RprUsd_MaterialNetwork const& network,
+    SdfPath const& path,
+    std::set<SdfPath>* visited,
+    std::vector<SdfPath>* order) {
+    if (!visited->insert(path).second) {
+        return;
+    }
+
+    auto nodeIt = network.nodes.find(path);
+    if (nodeIt == network.nodes.end()) {
+        return;
+    }
+
+    for (auto& input : nodeIt->second.inputConnections) {
+        for (auto& connection : input.second) {
+            CollectReachable(network, connection.upstreamNode, visited, order);
+        }
+    }
+    order->push_back(path);
+}
+
+inline bool GetFloat(VtValue const& value, float* out) {
+    if (value.IsHolding<float>()) {
+        *out = value.UncheckedGet<float>();
+    } else if (value.IsHolding<double>()) {
+        *out = float(value.UncheckedGet<double>());
+    } else if (value.IsHolding<int>()) {
+        *out = float(value.UncheckedGet<int>());
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline bool GetColor(VtValue const& value, GfVec3f* out) {
+    if (value.IsHolding<GfVec3f>()) {
+        *out = value.UncheckedGet<GfVec3f>();
+        return true;
+    }
+
+    float scalar;
+    if (GetFloat(value, &scalar)) {
+        *out = GfVec3f(scalar);
+        return true;
+    }
+    return false;
+}
+
+/// Value of an unconnected input, \p defaultValue if the parameter is not authored
+template <typename T, typename Node>
+bool GetConstantInput(Node const& node, TfToken const& input, T defaultValue, bool (*get)(VtValue const&, T*), T* out) {
+    if (node.inputConnections.count(input)) {
+        return false;
+    }
+
+    auto it = node.parameters.find(input);
+    if (it == node.parameters.end()) {
+        *out = defaultValue;
+        return true;
+    }
+    return get(it->second, out);
+}
+
+template <typename Node>
+void MakeConstantTexture(Node* node, GfVec3f const& value) {
+    auto& tokens = GetTokens();
+    node->nodeTypeId = tokens.constantTexture;
+    node->parameters.clear();
+    node->parameters[tokens.value] = VtValue(value);
+    node->inputConnections.clear();
+}
+
+} // namespace RprUsd_MaterialNetworkOptimizer
+
+inline bool RprUsdOptimizeMaterialNetwork(RprUsd_MaterialNetwork* network, RprUsdMaterialNetworkOptimizerStats* stats) {
+    using namespace RprUsd_MaterialNetworkOptimizer;
+    auto& tokens = GetTokens();
+
+    RprUsdMaterialNetworkOptimizerStats localStats;
+    if (!stats) {
+        stats = &localStats;
+    }
+    bool isModified = false;
+
+    std::set<SdfPath> visited;
+    std::vector<SdfPath> order;
+    for (auto& terminal : network->terminals) {
+        CollectReachable(*network, terminal.second.upstreamNode, &visited, &order);
+    }
+
+    // Downstream connections to a collapsed node are redirected to the input it was replaced with
+    std::map<SdfPath, RprUsd_MaterialNetworkConnection> redirects;
+    auto redirect = [&redirects](RprUsd_MaterialNetworkConnection* connection) {
+        auto it = redirects.find(connection->upstreamNode);
+        if (it != redirects.end()) {
+            *connection = it->second;
+        }
+    };
+
+    auto isConstantTexture = [&](SdfPath const& path, GfVec3f* value) {
+        auto it = network->nodes.find(path);
+        return it != network->nodes.end() &&
+            it->second.nodeTypeId == tokens.constantTexture &&
+            GetConstantInput(it->second, tokens.value, GfVec3f(0.0f), GetColor, value);
+    };
+
+    // Upstream nodes are processed first, so redirect targets are final by the time they are used
+    for (auto& path : order) {
+        auto& node = network->nodes.at(path);
+
+        for (auto& input : node.inputConnections) {
+            for (auto& connection : input.second) {
+                redirect(&connection);
+            }
+        }
+
+        if (node.nodeTypeId == tokens.blendValue) {
+            for (auto& colorInput : {tokens.color0, tokens.color1}) {
+                auto it = node.inputConnections.find(colorInput);
+                GfVec3f value;
+                if (it != node.inputConnections.end() && it->second.size() == 1 &&
+                    isConstantTexture(it->second[0].upstreamNode, &value)) {
+                    node.parameters[colorInput] = VtValue(value);
+                    node.inputConnections.erase(it);
+                    ++stats->numFoldedConstants;
+                    isModified = true;
+                }
+            }
+
+            float weight;
+            if (!GetConstantInput(node, tokens.weight, 0.5f, GetFloat, &weight)) {
+                continue;
+            }
+
+            TfToken const* selectedInput = nullptr;
+            if (weight <= 0.0f) {
+                selectedInput = &tokens.color0;
+            } else if (weight >= 1.0f) {
+                selectedInput = &tokens.color1;
+            }
+
+            if (selectedInput) {
+                auto it = node.inputConnections.find(*selectedInput);
+                if (it != node.inputConnections.end()) {
+                    if (it->second.size() == 1) {
+                        redirects[path] = it->second[0];
+                        ++stats->numCollapsedBlends;
+                        isModified = true;
+                    }
+                    continue;
+                }
+            }
+
+            GfVec3f color0, color1;
+            if (GetConstantInput(node, tokens.color0, GfVec3f(0.0f), GetColor, &color0) &&
+                GetConstantInput(node, tokens.color1, GfVec3f(0.0f), GetColor, &color1)) {
+                weight = std::min(std::max(weight, 0.0f), 1.0f);
+                MakeConstantTexture(&node, color0 * (1.0f - weight) + color1 * weight);
+                ++stats->numFoldedConstants;
+                isModified = true;
+            }
+        } else if (node.nodeTypeId == tokens.blend) {
+            // Other rpr_blend inputs (transmission_color, thickness) affect the output
+            // even when one shader is fully selected, keep such nodes as they are
+            if (HasOtherInputs(node, {tokens.color0, tokens.color1, tokens.weight})) {
+                continue;
+            }
+
+            auto color0It = node.inputConnections.find(tokens.color0);
+            auto color1It = node.inputConnections.find(tokens.color1);
+            auto getSingle = [&node](decltype(color0It) it) -> RprUsd_MaterialNetworkConnection const* {
+                return it != node.inputConnections.end() && it->second.size() == 1 ? &it->second[0] : nullptr;
+            };
+            auto color0 = getSingle(color0It);
+            auto color1 = getSingle(color1It);
+
+            RprUsd_MaterialNetworkConnection const* selected = nullptr;
+            float weight;
+            if (color0 && color1 &&
+                color0->upstreamNode == color1->upstreamNode &&
+                color0->upstreamOutputName == color1->upstreamOutputName) {
+                selected = color0;
+            } else if (GetConstantInput(node, tokens.weight, 0.0f, GetFloat, &weight)) {
+                if (weight <= 0.0f) {
+                    selected = color0;
+                } else if (weight >= 1.0f) {
+                    selected = color1;
+                }
+            }
+
+            if (selected) {
+                redirects[path] = *selected;
+                ++stats->numCollapsedBlends;
+                isModified = true;
+            }
+        }
+    }
+
+    for (auto& terminal : network->terminals) {
+        redirect(&terminal.second);
+    }
+
+    // Drop everything that no longer feeds a terminal, including collapsed nodes
+    std::set<SdfPath> reachable;
+    std::vector<SdfPath> reachableOrder;
+    for (auto& terminal : network->terminals) {
+        CollectReachable(*network, terminal.second.upstreamNode, &reachable, &reachableOrder);
+    }
+    for (auto it = network->nodes.begin(); it != network->nodes.end();) {
+        if (!reachable.count(it->first)) {
+            it = network->nodes.erase(it);
+            ++stats->numRemovedNodes;
+            isModified = true;
+        } else {
+            ++it;
+        }
+    }
+
+    return isModified;
+}
+
+inline void RprUsdMaterialNetworkToHdMaterialNetworkMap(
+    RprUsd_MaterialNetwork const& network,
+    HdMaterialNetworkMap const& sourceNetworkMap,
+    HdMaterialNetworkMap* result) {
+    using namespace RprUsd_MaterialNetworkOptimizer;
+
+    result->map.clear();
+    result->terminals.clear();
+
+    for (auto& terminal : network.terminals) {
+        auto& hdNetwork = result->map[terminal.first];
+
+        auto sourceIt = sourceNetworkMap.map.find(terminal.first);
+        if (sourceIt != sourceNetworkMap.map.end()) {
+            hdNetwork.primvars = sourceIt->second.primvars;
+        }
+
+        // Hydra takes the last node of the network as the terminal node
+        std::set<SdfPath> visited;
+        std::vector<SdfPath> order;
+        CollectReachable(network, terminal.second.upstreamNode, &visited, &order);
+        if (!order.empty()) {
+            result->terminals.push_back(order.back());
+        }
+
+        for (auto& path : order) {
+            auto& node = network.nodes.at(path);
+
+            HdMaterialNode hdNode;
+            hdNode.path = path;
+            hdNode.identifier = node.nodeTypeId;
+            hdNode.parameters = node.parameters;
+            hdNetwork.nodes.push_back(std::move(hdNode));
+
+            for (auto& input : node.inputConnections) {
+                for (auto& connection : input.second) {
+                    hdNetwork.relationships.push_back({connection.upstreamNode, connection.upstreamOutputName, path, input.first});
+                }
+            }
+        }
+    }
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_MATERIAL_NETWORK_OPTIMIZER_H
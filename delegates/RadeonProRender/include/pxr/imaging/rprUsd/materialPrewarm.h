@@ -0,0 +1,265 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_MATERIAL_PREWARM_H
+#define PXR_IMAGING_RPR_USD_MATERIAL_PREWARM_H
+
+#include "pxr/imaging/rprUsd/fileReadAhead.h"
+#include "pxr/imaging/rprUsd/materialNetworkHash.h"
+#include "pxr/imaging/rprUsd/mtlxLibraryIndex.h"
+#include "pxr/base/arch/fileSystem.h"
+#include "pxr/base/js/json.h"
+#include "pxr/base/tf/fileUtils.h"
+#include "pxr/base/tf/getenv.h"
+#include "pxr/base/tf/stringUtils.h"
+#include "pxr/base/work/dispatcher.h"
+#include "pxr/usd/sdf/assetPath.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdPrewarmManifest
+///
+/// Material hashes, texture files and MaterialX nodedefs used by a session,
+/// saved as JSON so that the next session that opens a similar stage can
+/// decode and parse them before Hydra asks for them. Thread-safe.
+///
+/// Material hashes are RprUsdCanonicalMaterialNetwork hashes. Materials can not
+/// be rebuilt from a hash alone, so they are only used to report how much of
+/// the manifest a session actually used.
+///
+class RprUsdPrewarmManifest {
+    static constexpr int kVersion = 1;
+
+public:
+    /// Manifest path from RPRUSD_MATERIAL_PREWARM_MANIFEST, empty if prewarming is disabled
+    static std::string GetDefaultPath() {
+        return TfGetenv("RPRUSD_MATERIAL_PREWARM_MANIFEST");
+    }
+
+    /// Records the network hash, node types and texture files of \p network
+    void AddMaterialNetwork(RprUsdCanonicalMaterialNetwork const& network);
+
+    void AddMaterialHash(uint64_t hash) { std::lock_guard<std::mutex> lock(m_mutex); m_materialHashes.insert(hash); }
+    void AddTexture(std::string const& path) { std::lock_guard<std::mutex> lock(m_mutex); m_textures.insert(path); }
+    void AddNodeDef(std::string const& name) { std::lock_guard<std::mutex> lock(m_mutex); m_nodeDefs.insert(name); }
+
+    bool HasMaterialHash(uint64_t hash) const { std::lock_guard<std::mutex> lock(m_mutex); return m_materialHashes.count(hash) != 0; }
+
+    std::vector<uint64_t> GetMaterialHashes() const { std::lock_guard<std::mutex> lock(m_mutex); return {m_materialHashes.begin(), m_materialHashes.end()}; }
+    std::vector<std::string> GetTextures() const { std::lock_guard<std::mutex> lock(m_mutex); return {m_textures.begin(), m_textures.end()}; }
+    std::vector<std::string> GetNodeDefs() const { std::lock_guard<std::mutex> lock(m_mutex); return {m_nodeDefs.begin(), m_nodeDefs.end()}; }
+
+    bool IsEmpty() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_materialHashes.empty() && m_textures.empty() && m_nodeDefs.empty();
+    }
+
+    /// Merges the manifest stored at \p filepath into this one
+    bool Load(std::string const& filepath);
+
+    bool Save(std::string const& filepath) const;
+
+private:
+    mutable std::mutex m_mutex;
+    std::set<uint64_t> m_materialHashes;
+    std::set<std::string> m_textures;
+    std::set<std::string> m_nodeDefs;
+};
+
+inline void RprUsdPrewarmManifest::AddMaterialNetwork(RprUsdCanonicalMaterialNetwork const& network) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_materialHashes.insert(network.GetHash());
+
+    for (auto& node : network.GetNodes()) {
+        m_nodeDefs.insert(node.nodeTypeId.GetString());
+
+        for (auto& parameter : node.parameters) {
+            if (parameter.second.IsHolding<SdfAssetPath>()) {
+                auto& path = parameter.second.UncheckedGet<SdfAssetPath>().GetResolvedPath();
+                if (!path.empty()) {
+                    m_textures.insert(path);
+                }
+            }
+        }
+    }
+}
+
+inline bool RprUsdPrewarmManifest::Load(std::string const& filepath) {
+    std::ifstream stream(filepath);
+    if (!stream) {
+        return false;
+    }
+
+    JsParseError error;
+    auto root = JsParseStream(stream, &error);
+    if (!root.IsObject()) {
+        TF_WARN("Failed to parse prewarm manifest %s:%u:%u: %s", filepath.c_str(), error.line, error.column, error.reason.c_str());
+        return false;
+    }
+
+    auto& object = root.GetJsObject();
+    auto versionIt = object.find("version");
+    if (versionIt == object.end() || !versionIt->second.IsInt() || versionIt->second.GetInt() != kVersion) {
+        return false;
+    }
+
+    auto forEachString = [&object](const char* name, std::function<void(std::string const&)> const& fn) {
+        auto it = object.find(name);
+        if (it != object.end() && it->second.IsArray()) {
+            for (auto& value : it->second.GetJsArray()) {
+                if (value.IsString()) {
+                    fn(value.GetString());
+                }
+            }
+        }
+    };
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // Hashes are stored as hex strings, JSON numbers can not hold all 64-bit values
+    forEachString("materials", [this](std::string const& hash) {
+        m_materialHashes.insert(std::strtoull(hash.c_str(), nullptr, 16));
+    });
+    forEachString("textures", [this](std::string const& path) { m_textures.insert(path); });
+    forEachString("nodedefs", [this](std::string const& name) { m_nodeDefs.insert(name); });
+    return true;
+}
+
+inline bool RprUsdPrewarmManifest::Save(std::string const& filepath) const {
+    JsArray materials, textures, nodeDefs;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto hash : m_materialHashes) {
+            materials.push_back(JsValue(TfStringPrintf("%016llx", (unsigned long long)hash)));
+        }
+        for (auto& path : m_textures) {
+            textures.push_back(JsValue(path));
+        }
+        for (auto& name : m_nodeDefs) {
+            nodeDefs.push_back(JsValue(name));
+        }
+    }
+
+    JsObject root;
+    root["version"] = JsValue(kVersion);
+    root["materials"] = JsValue(materials);
+    root["textures"] = JsValue(textures);
+    root["nodedefs"] = JsValue(nodeDefs);
+
+    // Replace atomically, the manifest might be read or saved by another session in the meantime.
+    // ArchMakeTmpFile picks a name no other session uses.
+    auto directory = TfGetPathName(filepath);
+    std::string tmpPath;
+    int tmpFile = ArchMakeTmpFile(directory.empty() ? "." : directory, TfGetBaseName(filepath), &tmpPath);
+    if (tmpFile == -1) {
+        return false;
+    }
+    ArchCloseFile(tmpFile);
+    {
+        std::ofstream stream(tmpPath);
+        if (stream) {
+            JsWriteToStream(JsValue(root), stream);
+        }
+        if (!stream) {
+            stream.close();
+            std::remove(tmpPath.c_str());
+            return false;
+        }
+    }
+    if (std::rename(tmpPath.c_str(), filepath.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+/// \class RprUsdMaterialPrewarmer
+///
+/// Reads the texture files of a manifest ahead and parses its nodedefs in the
+/// background. Meant to be created as soon as the rpr::Context exists. Textures
+/// are not decoded: RprUsdImageCache and the material registry decode on their
+/// own, the read ahead only lets them find the files in the OS file cache.
+/// Nothing is kept in memory, so the manifest size does not bound memory use.
+///
+class RprUsdMaterialPrewarmer {
+public:
+    struct Stats {
+        size_t numTextures = 0;
+        size_t numNodeDefs = 0;
+    };
+
+    /// \p libraryIndex may be nullptr, nodedefs are not prewarmed then
+    RprUsdMaterialPrewarmer(RprUsdPrewarmManifest const& manifest, RprUsdMtlxLibraryIndex* libraryIndex);
+
+    ~RprUsdMaterialPrewarmer() {
+        m_dispatcher.Cancel();
+        m_dispatcher.Wait();
+    }
+
+    void Wait() { m_dispatcher.Wait(); }
+
+    Stats GetStats() const {
+        Stats stats;
+        stats.numTextures = m_numTextures;
+        stats.numNodeDefs = m_numNodeDefs;
+        return stats;
+    }
+
+private:
+    WorkDispatcher m_dispatcher;
+
+    std::atomic<size_t> m_numTextures{0};
+    std::atomic<size_t> m_numNodeDefs{0};
+};
+
+inline RprUsdMaterialPrewarmer::RprUsdMaterialPrewarmer(RprUsdPrewarmManifest const& manifest, RprUsdMtlxLibraryIndex* libraryIndex) {
+    for (auto& path : manifest.GetTextures()) {
+        // UDIM sets are loaded tile by tile on demand
+        if (path.find("<UDIM>") != std::string::npos) {
+            continue;
+        }
+
+        m_dispatcher.Run([this, path]() {
+            if (TfIsFile(path)) {
+                RprUsdReadFileAhead(path);
+                ++m_numTextures;
+            }
+        });
+    }
+
+    if (libraryIndex) {
+        auto nodeDefs = manifest.GetNodeDefs();
+        m_dispatcher.Run([this, libraryIndex, nodeDefs]() {
+            for (auto& name : nodeDefs) {
+                // Non-MaterialX node types (e.g. UsdPreviewSurface) are simply not found
+                if (libraryIndex->GetNodeDef(name)) {
+                    ++m_numNodeDefs;
+                }
+            }
+        });
+    }
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_MATERIAL_PREWARM_H
@@ -0,0 +1,387 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_MTLX_DOCUMENT_CACHE_H
+#define PXR_IMAGING_RPR_USD_MTLX_DOCUMENT_CACHE_H
+
+#include "pxr/imaging/rprUsd/configSnapshot.h"
+#include "pxr/imaging/rprUsd/textureContentHash.h"
+#include "pxr/base/arch/fileSystem.h"
+#include "pxr/base/arch/hash.h"
+#include "pxr/base/tf/fileUtils.h"
+#include "pxr/base/tf/getenv.h"
+#include "pxr/base/tf/stringUtils.h"
+
+#include <MaterialXCore/Document.h>
+#include <MaterialXFormat/File.h>
+#include <MaterialXFormat/XmlIo.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdMtlxDocumentCache
+///
+/// Caches MaterialX documents after their includes are resolved and their
+/// node graphs are flattened against the MaterialX libraries. Results are kept
+/// in memory for the session and written to disk, so later sessions that use
+/// the same documents with the same library set read one self-contained file
+/// instead of resolving includes and flattening again.
+///
+/// Entries are keyed by the content hash of the document, its location (for
+/// relative includes), the hash of the library set and the MaterialX version.
+/// Files pulled in with XInclude are not part of the key: every entry records
+/// the content hashes of its resolved include closure, and an entry whose
+/// included files have changed since is processed again. Returned documents
+/// do not contain library elements; they are shared and must not be modified
+/// by the caller.
+///
+/// The cache directory defaults to RPRUSD_MTLX_CACHE_DIR or, if it's not set,
+/// to the "mtlx" subdirectory of the texture cache directory. Entries are
+/// removed by Clear and by the "Clear Texture Cache" usdview menu action.
+///
+class RprUsdMtlxDocumentCache {
+    static constexpr uint32_t kVersion = 2;
+
+public:
+    struct Stats {
+        size_t numMemoryHits = 0;
+        size_t numDiskHits = 0;
+        size_t numMisses = 0;
+    };
+
+    static std::string GetDefaultCacheDir() {
+        auto cacheDir = TfGetenv("RPRUSD_MTLX_CACHE_DIR");
+        if (!cacheDir.empty()) {
+            return cacheDir;
+        }
+
+        return RprUsdConfigSnapshot::GetLatest().textureCacheDir + "/mtlx";
+    }
+
+    /// Hash of the content of all .mtlx files in \p librariesDir, order independent
+    static uint64_t HashLibraries(std::string const& librariesDir);
+
+    /// \p libraries is the document the cached documents are flattened against,
+    /// \p librariesHash identifies its content, e.g. as computed by HashLibraries
+    RprUsdMtlxDocumentCache(
+        MaterialX::ConstDocumentPtr libraries,
+        uint64_t librariesHash,
+        std::string cacheDir = GetDefaultCacheDir())
+        : m_libraries(std::move(libraries))
+        , m_librariesHash(librariesHash)
+        , m_cacheDir(std::move(cacheDir)) {}
+
+    std::string const& GetCacheDir() const { return m_cacheDir; }
+
+    /// Flattened document of the .mtlx file \p filepath, nullptr if it can not be loaded
+    MaterialX::DocumentPtr GetFlattenedDocument(std::string const& filepath);
+
+    /// Flattened document of the MaterialX XML \p mtlxString, relative includes are resolved against \p basePath
+    MaterialX::DocumentPtr GetFlattenedDocumentFromString(std::string const& mtlxString, std::string const& basePath);
+
+    /// Removes all cache entries from the disk and memory
+    size_t Clear();
+
+    Stats GetStats() const;
+
+private:
+    static const char* GetFileExtension() { return ".mtlx"; }
+    // Document attribute entries store their include closure in
+    static const char* GetIncludesAttribute() { return "rprUsdIncludes"; }
+
+    // (resolved filepath, content hash) of every file read through XInclude
+    using Includes = std::vector<std::pair<std::string, uint64_t>>;
+
+    struct CachedDocument {
+        MaterialX::DocumentPtr document;
+        Includes includes;
+    };
+
+    uint64_t GetKey(uint64_t contentHash, std::string const& location) const;
+    std::string GetEntryPath(uint64_t key) const;
+
+    template <typename ReadDocument>
+    MaterialX::DocumentPtr GetOrCreate(uint64_t key, ReadDocument&& readDocument);
+
+    bool AreIncludesUpToDate(Includes const& includes);
+    static std::string EncodeIncludes(Includes const& includes);
+    static bool DecodeIncludes(std::string const& encoded, Includes* includes);
+
+    bool Load(std::string const& entryPath, CachedDocument* cached) const;
+    void Store(std::string const& entryPath, std::string const& xml) const;
+
+private:
+    MaterialX::ConstDocumentPtr m_libraries;
+    uint64_t m_librariesHash;
+    std::string m_cacheDir;
+
+    RprUsdTextureContentHasher m_contentHasher;
+
+    mutable std::mutex m_mutex;
+    std::unordered_map<uint64_t, CachedDocument> m_documents;
+
+    size_t m_numMemoryHits = 0;
+    size_t m_numDiskHits = 0;
+    size_t m_numMisses = 0;
+};
+
+inline uint64_t RprUsdMtlxDocumentCache::HashLibraries(std::string const& librariesDir) {
+    auto files = TfListDir(librariesDir, true);
+    files.erase(std::remove_if(files.begin(), files.end(),
+        [](std::string const& file) { return !TfStringEndsWith(file, ".mtlx"); }), files.end());
+    std::sort(files.begin(), files.end());
+
+    RprUsdTextureContentHasher hasher;
+    uint64_t hash = files.size();
+    for (auto& file : files) {
+        uint64_t fileHash;
+        if (hasher.GetHash(file, &fileHash)) {
+            hash ^= fileHash + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+        }
+    }
+    return hash;
+}
+
+inline uint64_t RprUsdMtlxDocumentCache::GetKey(uint64_t contentHash, std::string const& location) const {
+    auto keyString = TfStringPrintf("%u|%016llx|%016llx|%s|%s",
+        kVersion, (unsigned long long)contentHash, (unsigned long long)m_librariesHash,
+        MaterialX::getVersionString().c_str(), location.c_str());
+    return ArchHash64(keyString.c_str(), keyString.size());
+}
+
+inline std::string RprUsdMtlxDocumentCache::GetEntryPath(uint64_t key) const {
+    return TfStringPrintf("%s/%016llx%s", m_cacheDir.c_str(), (unsigned long long)key, GetFileExtension());
+}
+
+inline MaterialX::DocumentPtr RprUsdMtlxDocumentCache::GetFlattenedDocument(std::string const& filepath) {
+    uint64_t contentHash;
+    if (!m_contentHasher.GetHash(filepath, &contentHash)) {
+        TF_RUNTIME_ERROR("Failed to read MaterialX file: %s", filepath.c_str());
+        return nullptr;
+    }
+
+    return GetOrCreate(GetKey(contentHash, filepath),
+        [&filepath](MaterialX::DocumentPtr const& document, MaterialX::XmlReadOptions const* readOptions) {
+            MaterialX::readFromXmlFile(document, filepath, MaterialX::FileSearchPath(), readOptions);
+        }
+    );
+}
+
+inline MaterialX::DocumentPtr RprUsdMtlxDocumentCache::GetFlattenedDocumentFromString(std::string const& mtlxString, std::string const& basePath) {
+    uint64_t contentHash = ArchHash64(mtlxString.c_str(), mtlxString.size(), uint64_t(mtlxString.size()));
+    return GetOrCreate(GetKey(contentHash, basePath),
+        [&mtlxString, &basePath](MaterialX::DocumentPtr const& document, MaterialX::XmlReadOptions const* readOptions) {
+            MaterialX::readFromXmlString(document, mtlxString, MaterialX::FileSearchPath(basePath), readOptions);
+        }
+    );
+}
+
+template <typename ReadDocument>
+MaterialX::DocumentPtr RprUsdMtlxDocumentCache::GetOrCreate(uint64_t key, ReadDocument&& readDocument) {
+    Includes cachedIncludes;
+    MaterialX::DocumentPtr cachedDocument;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_documents.find(key);
+        if (it != m_documents.end()) {
+            cachedIncludes = it->second.includes;
+            cachedDocument = it->second.document;
+        }
+    }
+    // Included files are hashed outside of the lock
+    if (cachedDocument && AreIncludesUpToDate(cachedIncludes)) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_numMemoryHits;
+        return cachedDocument;
+    }
+
+    auto entryPath = GetEntryPath(key);
+    CachedDocument cached;
+    bool isDiskHit = Load(entryPath, &cached) && AreIncludesUpToDate(cached.includes);
+
+    if (!isDiskHit) {
+        cached.includes.clear();
+        std::string xml;
+        try {
+            // Record every file XInclude reads, including nested includes
+            std::vector<std::string> includedFiles;
+            MaterialX::XmlReadOptions readOptions;
+            readOptions.readXIncludeFunction = [&includedFiles](
+                MaterialX::DocumentPtr document, MaterialX::FilePath const& filename,
+                MaterialX::FileSearchPath const& searchPath, MaterialX::XmlReadOptions const* options) {
+                includedFiles.push_back(searchPath.find(filename).asString());
+                MaterialX::readFromXmlFile(document, filename, searchPath, options);
+            };
+
+            auto flattened = MaterialX::createDocument();
+            readDocument(flattened, &readOptions);
+            flattened->importLibrary(m_libraries);
+            flattened->flattenSubgraphs();
+
+            for (auto& includedFile : includedFiles) {
+                uint64_t includeHash;
+                if (m_contentHasher.GetHash(includedFile, &includeHash)) {
+                    cached.includes.emplace_back(includedFile, includeHash);
+                }
+            }
+            flattened->setAttribute(GetIncludesAttribute(), EncodeIncludes(cached.includes));
+
+            // Library elements are imported again by whoever consumes the document, leave them out
+            MaterialX::XmlWriteOptions writeOptions;
+            writeOptions.writeXIncludeEnable = false;
+            auto& libraries = m_libraries;
+            writeOptions.elementPredicate = [&libraries](MaterialX::ConstElementPtr element) {
+                return !libraries->getChild(element->getName());
+            };
+            xml = MaterialX::writeToXmlString(flattened, &writeOptions);
+
+            cached.document = MaterialX::createDocument();
+            MaterialX::readFromXmlString(cached.document, xml);
+            cached.document->removeAttribute(GetIncludesAttribute());
+        } catch (std::exception& e) {
+            TF_RUNTIME_ERROR("Failed to process MaterialX document: %s", e.what());
+            return nullptr;
+        }
+        Store(entryPath, xml);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (isDiskHit) {
+        ++m_numDiskHits;
+    } else {
+        ++m_numMisses;
+    }
+    auto& entry = m_documents[key];
+    // Another thread might have processed the same document in the meantime
+    if (!entry.document || entry.document == cachedDocument) {
+        entry = std::move(cached);
+    }
+    return entry.document;
+}
+
+inline bool RprUsdMtlxDocumentCache::AreIncludesUpToDate(Includes const& includes) {
+    for (auto& include : includes) {
+        uint64_t hash;
+        if (!m_contentHasher.GetHash(include.first, &hash) || hash != include.second) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline std::string RprUsdMtlxDocumentCache::EncodeIncludes(Includes const& includes) {
+    // "<hash>:<path>|<hash>:<path>", '|' is not valid in paths on Windows and very rare elsewhere
+    std::string encoded;
+    for (auto& include : includes) {
+        if (!encoded.empty()) {
+            encoded += '|';
+        }
+        encoded += TfStringPrintf("%016llx:%s", (unsigned long long)include.second, include.first.c_str());
+    }
+    return encoded;
+}
+
+inline bool RprUsdMtlxDocumentCache::DecodeIncludes(std::string const& encoded, Includes* includes) {
+    for (auto& item : TfStringSplit(encoded, "|")) {
+        if (item.size() < 18 || item[16] != ':') {
+            return false;
+        }
+        char* end;
+        uint64_t hash = std::strtoull(item.substr(0, 16).c_str(), &end, 16);
+        includes->emplace_back(item.substr(17), hash);
+    }
+    return true;
+}
+
+inline bool RprUsdMtlxDocumentCache::Load(std::string const& entryPath, CachedDocument* cached) const {
+    if (!TfIsFile(entryPath)) {
+        return false;
+    }
+
+    try {
+        auto document = MaterialX::createDocument();
+        MaterialX::readFromXmlFile(document, entryPath);
+        // Entries without the attribute were written by an incompatible version
+        if (!document->hasAttribute(GetIncludesAttribute()) ||
+            !DecodeIncludes(document->getAttribute(GetIncludesAttribute()), &cached->includes)) {
+            return false;
+        }
+        document->removeAttribute(GetIncludesAttribute());
+        cached->document = std::move(document);
+        return true;
+    } catch (std::exception& e) {
+        TF_WARN("Corrupted MaterialX cache entry %s: %s", entryPath.c_str(), e.what());
+        return false;
+    }
+}
+
+inline void RprUsdMtlxDocumentCache::Store(std::string const& entryPath, std::string const& xml) const {
+    if (!TfMakeDirs(m_cacheDir, -1, true)) {
+        return;
+    }
+
+    // Write into a unique temporary file first so that concurrent writers and readers never observe partial entries.
+    // ArchMakeTmpFile picks a name no other thread or process uses.
+    std::string tmpPath;
+    int tmpFile = ArchMakeTmpFile(m_cacheDir, TfGetBaseName(entryPath), &tmpPath);
+    if (tmpFile == -1) {
+        return;
+    }
+    ArchCloseFile(tmpFile);
+    FILE* file = ArchOpenFile(tmpPath.c_str(), "wb");
+    if (!file) {
+        std::remove(tmpPath.c_str());
+        return;
+    }
+    bool success = std::fwrite(xml.data(), 1, xml.size(), file) == xml.size();
+    success = std::fclose(file) == 0 && success;
+
+    if (!success || std::rename(tmpPath.c_str(), entryPath.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+    }
+}
+
+inline size_t RprUsdMtlxDocumentCache::Clear() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_documents.clear();
+    }
+
+    size_t numRemoved = 0;
+    for (auto& file : TfListDir(m_cacheDir)) {
+        if (TfStringEndsWith(file, GetFileExtension()) && TfDeleteFile(file)) {
+            ++numRemoved;
+        }
+    }
+    return numRemoved;
+}
+
+inline RprUsdMtlxDocumentCache::Stats RprUsdMtlxDocumentCache::GetStats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats stats;
+    stats.numMemoryHits = m_numMemoryHits;
+    stats.numDiskHits = m_numDiskHits;
+    stats.numMisses = m_numMisses;
+    return stats;
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_MTLX_DOCUMENT_CACHE_H
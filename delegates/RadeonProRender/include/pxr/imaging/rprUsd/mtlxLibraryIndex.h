@@ -0,0 +1,259 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_MTLX_LIBRARY_INDEX_H
+#define PXR_IMAGING_RPR_USD_MTLX_LIBRARY_INDEX_H
+
+#include "pxr/pxr.h"
+#include "pxr/base/tf/diagnostic.h"
+#include "pxr/base/tf/fileUtils.h"
+#include "pxr/base/tf/stringUtils.h"
+
+#include <MaterialXCore/Document.h>
+#include <MaterialXFormat/XmlIo.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdMtlxLibraryIndex
+///
+/// Lazily loaded set of MaterialX libraries (stdlib, pbrlib, bxdf, rpr_* nodes).
+///
+/// Construction only starts a background scan of the library directories that
+/// records which file defines which nodedef. The scan reads the files as plain
+/// text and does not build MaterialX documents. A library file is parsed the
+/// first time one of its nodedefs is requested, and the complete library
+/// document is built only when GetLibraries is called, e.g. by the first
+/// MaterialX network. Scenes that use only UsdPreviewSurface never parse
+/// any MaterialX library.
+///
+class RprUsdMtlxLibraryIndex {
+public:
+    struct Stats {
+        size_t numFiles = 0;
+        size_t numNodeDefs = 0;
+        size_t numParsedFiles = 0;
+        bool areLibrariesLoaded = false;
+    };
+
+    /// Starts indexing .mtlx files found recursively in \p libraryDirs
+    explicit RprUsdMtlxLibraryIndex(std::vector<std::string> libraryDirs);
+
+    RprUsdMtlxLibraryIndex(RprUsdMtlxLibraryIndex const&) = delete;
+    RprUsdMtlxLibraryIndex& operator=(RprUsdMtlxLibraryIndex const&) = delete;
+
+    /// True if the background scan has finished, never blocks
+    bool IsIndexed() const;
+
+    /// Names of nodedefs implementing \p node (e.g. "ND_image_color3" for "image"), waits for the scan
+    std::vector<std::string> GetNodeDefNames(std::string const& node) const;
+
+    /// Parses the file defining \p nodeDefName on first use, nullptr if no library defines it
+    MaterialX::NodeDefPtr GetNodeDef(std::string const& nodeDefName);
+
+    /// Document with all libraries imported, built on first call
+    MaterialX::ConstDocumentPtr GetLibraries();
+
+    Stats GetStats() const;
+
+private:
+    struct Index {
+        std::vector<std::string> files;
+        std::unordered_map<std::string, size_t> nodeDefFiles;
+        std::unordered_map<std::string, std::vector<std::string>> nodeDefsByNode;
+    };
+
+    static Index BuildIndex(std::vector<std::string> const& libraryDirs);
+    static void ScanFile(std::string const& content, size_t fileIndex, Index* index);
+    static std::string GetXmlAttribute(std::string const& content, size_t tagBegin, size_t tagEnd, const char* name);
+
+    Index const& GetIndex() const { return m_index.get(); }
+    MaterialX::DocumentPtr GetFileDocument(size_t fileIndex);
+
+private:
+    std::shared_future<Index> m_index;
+
+    mutable std::mutex m_mutex;
+    std::unordered_map<size_t, MaterialX::DocumentPtr> m_fileDocuments;
+    MaterialX::DocumentPtr m_libraries;
+};
+
+inline RprUsdMtlxLibraryIndex::RprUsdMtlxLibraryIndex(std::vector<std::string> libraryDirs) {
+    m_index = std::async(std::launch::async,
+        [libraryDirs = std::move(libraryDirs)]() {
+            return BuildIndex(libraryDirs);
+        }
+    ).share();
+}
+
+inline bool RprUsdMtlxLibraryIndex::IsIndexed() const {
+    return m_index.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+inline RprUsdMtlxLibraryIndex::Index RprUsdMtlxLibraryIndex::BuildIndex(std::vector<std::string> const& libraryDirs) {
+    Index index;
+    for (auto& libraryDir : libraryDirs) {
+        for (auto& file : TfListDir(libraryDir, true)) {
+            if (TfStringEndsWith(file, ".mtlx")) {
+                index.files.push_back(file);
+            }
+        }
+    }
+    // Deterministic order so that the first definition of a duplicated nodedef always wins
+    std::sort(index.files.begin(), index.files.end());
+
+    for (size_t i = 0; i < index.files.size(); ++i) {
+        std::ifstream stream(index.files[i], std::ios::binary);
+        if (!stream) {
+            TF_WARN("Failed to read MaterialX library: %s", index.files[i].c_str());
+            continue;
+        }
+        std::string content((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+        ScanFile(content, i, &index);
+    }
+    return index;
+}
+
+inline void RprUsdMtlxLibraryIndex::ScanFile(std::string const& content, size_t fileIndex, Index* index) {
+    static const std::string kNodeDefTag = "<nodedef";
+
+    for (size_t pos = content.find(kNodeDefTag); pos != std::string::npos; pos = content.find(kNodeDefTag, pos + 1)) {
+        size_t tagEnd = content.find('>', pos);
+        if (tagEnd == std::string::npos) {
+            break;
+        }
+
+        auto name = GetXmlAttribute(content, pos, tagEnd, "name");
+        auto node = GetXmlAttribute(content, pos, tagEnd, "node");
+        if (name.empty()) {
+            continue;
+        }
+
+        if (index->nodeDefFiles.emplace(name, fileIndex).second && !node.empty()) {
+            index->nodeDefsByNode[node].push_back(std::move(name));
+        }
+    }
+}
+
+inline std::string RprUsdMtlxLibraryIndex::GetXmlAttribute(std::string const& content, size_t tagBegin, size_t tagEnd, const char* name) {
+    std::string pattern = std::string(name) + "=\"";
+    for (size_t pos = content.find(pattern, tagBegin); pos != std::string::npos && pos < tagEnd; pos = content.find(pattern, pos + 1)) {
+        // Skip attributes that merely end with the name, e.g. uiname
+        if (!std::isspace(static_cast<unsigned char>(content[pos - 1]))) {
+            continue;
+        }
+
+        size_t valueBegin = pos + pattern.size();
+        size_t valueEnd = content.find('"', valueBegin);
+        if (valueEnd == std::string::npos || valueEnd > tagEnd) {
+            break;
+        }
+        return content.substr(valueBegin, valueEnd - valueBegin);
+    }
+    return {};
+}
+
+inline std::vector<std::string> RprUsdMtlxLibraryIndex::GetNodeDefNames(std::string const& node) const {
+    auto& index = GetIndex();
+    auto it = index.nodeDefsByNode.find(node);
+    if (it == index.nodeDefsByNode.end()) {
+        return {};
+    }
+    return it->second;
+}
+
+inline MaterialX::DocumentPtr RprUsdMtlxLibraryIndex::GetFileDocument(size_t fileIndex) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_fileDocuments.find(fileIndex);
+        if (it != m_fileDocuments.end()) {
+            return it->second;
+        }
+    }
+
+    auto& filepath = GetIndex().files[fileIndex];
+    auto document = MaterialX::createDocument();
+    try {
+        MaterialX::readFromXmlFile(document, filepath);
+    } catch (std::exception& e) {
+        TF_RUNTIME_ERROR("Failed to parse MaterialX library %s: %s", filepath.c_str(), e.what());
+        document = nullptr;
+    }
+
+    // Another thread might have parsed the same file in the meantime
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_fileDocuments.emplace(fileIndex, std::move(document)).first->second;
+}
+
+inline MaterialX::NodeDefPtr RprUsdMtlxLibraryIndex::GetNodeDef(std::string const& nodeDefName) {
+    auto& index = GetIndex();
+    auto it = index.nodeDefFiles.find(nodeDefName);
+    if (it == index.nodeDefFiles.end()) {
+        return nullptr;
+    }
+
+    auto document = GetFileDocument(it->second);
+    return document ? document->getNodeDef(nodeDefName) : nullptr;
+}
+
+inline MaterialX::ConstDocumentPtr RprUsdMtlxLibraryIndex::GetLibraries() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_libraries) {
+            return m_libraries;
+        }
+    }
+
+    auto libraries = MaterialX::createDocument();
+    auto& index = GetIndex();
+    for (size_t i = 0; i < index.files.size(); ++i) {
+        if (auto document = GetFileDocument(i)) {
+            libraries->importLibrary(document);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_libraries) {
+        m_libraries = std::move(libraries);
+    }
+    return m_libraries;
+}
+
+inline RprUsdMtlxLibraryIndex::Stats RprUsdMtlxLibraryIndex::GetStats() const {
+    Stats stats;
+    if (IsIndexed()) {
+        auto& index = GetIndex();
+        stats.numFiles = index.files.size();
+        stats.numNodeDefs = index.nodeDefFiles.size();
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    stats.numParsedFiles = m_fileDocuments.size();
+    stats.areLibrariesLoaded = bool(m_libraries);
+    return stats;
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_MTLX_LIBRARY_INDEX_H
@@ -0,0 +1,503 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_TEXEL_CONVERSION_H
+#define PXR_IMAGING_RPR_USD_TEXEL_CONVERSION_H
+
+#include "pxr/imaging/rprUsd/util.h"
+#include "pxr/base/gf/half.h"
+#include "pxr/base/arch/defines.h"
+
+#include <RadeonProRender.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Vector kernels are compiled for their ISA regardless of the build flags and
+// picked at runtime, so a build for the x86-64 baseline still uses AVX2 where
+// the CPU has it. x86-64 always has SSE2, other CPUs only use the scalar loops.
+#if defined(ARCH_CPU_INTEL)
+#define RPRUSD_TEXEL_X86
+#include <immintrin.h>
+#if defined(ARCH_COMPILER_MSVC)
+#include <intrin.h>
+// MSVC accepts any intrinsic without enabling the ISA for the whole file
+#define RPRUSD_TEXEL_TARGET(isa)
+#else
+#include <cpuid.h>
+#define RPRUSD_TEXEL_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif // ARCH_CPU_INTEL
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// Texel component layouts met in the texture load path. Unlike rpr::ImageFormat
+/// it can describe 16-bit integer data that RPR does not accept directly.
+enum class RprUsdTexelType {
+    kUint8,
+    kUint16,
+    kFloat16,
+    kFloat32,
+};
+
+struct RprUsdTexelFormat {
+    uint32_t numComponents = 0;
+    RprUsdTexelType type = RprUsdTexelType::kUint8;
+
+    size_t GetComponentSize() const {
+        switch (type) {
+            case RprUsdTexelType::kUint8: return 1;
+            case RprUsdTexelType::kUint16:
+            case RprUsdTexelType::kFloat16: return 2;
+            default: return 4;
+        }
+    }
+    size_t GetTexelSize() const { return numComponents * GetComponentSize(); }
+};
+
+inline bool RprUsdGetTexelFormat(RprUsdTextureData const& textureData, RprUsdTexelFormat* format) {
+    auto glMetadata = textureData.GetGLMetadata();
+
+    switch (glMetadata.glFormat) {
+        case GL_RED: format->numComponents = 1; break;
+        case GL_RG: format->numComponents = 2; break;
+        case GL_RGB: format->numComponents = 3; break;
+        case GL_RGBA: format->numComponents = 4; break;
+        default: return false;
+    }
+
+    switch (glMetadata.glType) {
+        case GL_UNSIGNED_BYTE: format->type = RprUsdTexelType::kUint8; break;
+        case GL_UNSIGNED_SHORT: format->type = RprUsdTexelType::kUint16; break;
+        case GL_HALF_FLOAT: format->type = RprUsdTexelType::kFloat16; break;
+        case GL_FLOAT: format->type = RprUsdTexelType::kFloat32; break;
+        default: return false;
+    }
+
+    return true;
+}
+
+inline bool RprUsdGetImageFormat(RprUsdTexelFormat const& texelFormat, rpr::ImageFormat* format) {
+    format->num_components = texelFormat.numComponents;
+    switch (texelFormat.type) {
+        case RprUsdTexelType::kUint8: format->type = RPR_COMPONENT_TYPE_UINT8; return true;
+        case RprUsdTexelType::kFloat16: format->type = RPR_COMPONENT_TYPE_FLOAT16; return true;
+        case RprUsdTexelType::kFloat32: format->type = RPR_COMPONENT_TYPE_FLOAT32; return true;
+        default: return false;
+    }
+}
+
+/// Picks the most compact format RPR accepts for data in \p srcFormat consumed by an input
+/// that reads \p numComponentsRequired channels (zero means all). RPR has no 16-bit integer
+/// images, such data becomes half floats. With \p reducePrecision 32-bit floats are stored
+/// as half floats and 16-bit integers as 8-bit integers.
+inline RprUsdTexelFormat RprUsdChooseTexelFormat(RprUsdTexelFormat const& srcFormat, uint32_t numComponentsRequired, bool reducePrecision) {
+    RprUsdTexelFormat format = srcFormat;
+    if (numComponentsRequired && numComponentsRequired < format.numComponents) {
+        format.numComponents = numComponentsRequired;
+    }
+    if (format.type == RprUsdTexelType::kUint16) {
+        format.type = reducePrecision ? RprUsdTexelType::kUint8 : RprUsdTexelType::kFloat16;
+    } else if (format.type == RprUsdTexelType::kFloat32 && reducePrecision) {
+        format.type = RprUsdTexelType::kFloat16;
+    }
+    return format;
+}
+
+/// Instruction sets the conversion kernels can use on the current CPU
+struct RprUsdTexelIsa {
+    bool sse41 = false;
+    bool avx2 = false;
+    bool f16c = false;
+};
+
+#ifdef RPRUSD_TEXEL_X86
+
+inline void RprUsd_Cpuid(unsigned leaf, unsigned regs[4]) {
+#if defined(ARCH_COMPILER_MSVC)
+    int r[4];
+    __cpuidex(r, int(leaf), 0);
+    for (int i = 0; i < 4; ++i) regs[i] = unsigned(r[i]);
+#else
+    __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+/// AVX registers are only usable if the OS saves them on context switches
+inline bool RprUsd_IsAvxStateEnabled() {
+#if defined(ARCH_COMPILER_MSVC)
+    uint64_t xcr0 = _xgetbv(0);
+#else
+    uint32_t lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    uint64_t xcr0 = (uint64_t(hi) << 32) | lo;
+#endif
+    return (xcr0 & 0x6) == 0x6;
+}
+
+inline RprUsdTexelIsa RprUsd_DetectTexelIsa() {
+    RprUsdTexelIsa isa;
+
+    unsigned regs[4];
+    RprUsd_Cpuid(0, regs);
+    unsigned maxLeaf = regs[0];
+    if (maxLeaf < 1) {
+        return isa;
+    }
+
+    RprUsd_Cpuid(1, regs);
+    isa.sse41 = (regs[2] & (1u << 19)) != 0;
+    bool hasOsxsave = (regs[2] & (1u << 27)) != 0;
+    bool hasAvx = (regs[2] & (1u << 28)) != 0;
+    bool hasF16c = (regs[2] & (1u << 29)) != 0;
+    if (!hasOsxsave || !hasAvx || !RprUsd_IsAvxStateEnabled()) {
+        return isa;
+    }
+
+    isa.f16c = hasF16c;
+    if (maxLeaf >= 7) {
+        RprUsd_Cpuid(7, regs);
+        isa.avx2 = (regs[1] & (1u << 5)) != 0;
+    }
+    return isa;
+}
+
+#endif // RPRUSD_TEXEL_X86
+
+inline RprUsdTexelIsa const& RprUsdGetTexelIsa() {
+#ifdef RPRUSD_TEXEL_X86
+    static const RprUsdTexelIsa isa = RprUsd_DetectTexelIsa();
+#else
+    static const RprUsdTexelIsa isa;
+#endif
+    return isa;
+}
+
+//------------------------------------------------------------------------------
+// Component conversion kernels. Vector loops are separate functions compiled
+// for their ISA, they return the number of processed elements and the caller
+// finishes the remainder with a scalar loop.
+//------------------------------------------------------------------------------
+
+#ifdef RPRUSD_TEXEL_X86
+
+RPRUSD_TEXEL_TARGET("avx,f16c")
+inline size_t RprUsd_ConvertFloatToHalfF16c(float const* src, uint16_t* dst, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 v = _mm256_loadu_ps(src + i);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+    }
+    return i;
+}
+
+RPRUSD_TEXEL_TARGET("avx,f16c")
+inline size_t RprUsd_ConvertHalfToFloatF16c(uint16_t const* src, float* dst, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(v));
+    }
+    return i;
+}
+
+RPRUSD_TEXEL_TARGET("avx2")
+inline size_t RprUsd_ConvertUint16ToUint8Avx2(uint16_t const* src, uint8_t* dst, size_t count) {
+    const __m256i kBias = _mm256_set1_epi16(128);
+    const __m256i kHalfBias = _mm256_set1_epi16(64);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(src + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(src + i + 16));
+        a = _mm256_srli_epi16(_mm256_add_epi16(_mm256_sub_epi16(a, _mm256_srli_epi16(_mm256_add_epi16(_mm256_srli_epi16(a, 1), kHalfBias), 7)), kBias), 8);
+        b = _mm256_srli_epi16(_mm256_add_epi16(_mm256_sub_epi16(b, _mm256_srli_epi16(_mm256_add_epi16(_mm256_srli_epi16(b, 1), kHalfBias), 7)), kBias), 8);
+        // packus works per 128-bit lane, restore the element order afterwards
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), packed);
+    }
+    return i;
+}
+
+inline size_t RprUsd_ConvertUint16ToUint8Sse2(uint16_t const* src, uint8_t* dst, size_t count) {
+    const __m128i kBias = _mm_set1_epi16(128);
+    const __m128i kHalfBias = _mm_set1_epi16(64);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i + 8));
+        a = _mm_srli_epi16(_mm_add_epi16(_mm_sub_epi16(a, _mm_srli_epi16(_mm_add_epi16(_mm_srli_epi16(a, 1), kHalfBias), 7)), kBias), 8);
+        b = _mm_srli_epi16(_mm_add_epi16(_mm_sub_epi16(b, _mm_srli_epi16(_mm_add_epi16(_mm_srli_epi16(b, 1), kHalfBias), 7)), kBias), 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(a, b));
+    }
+    return i;
+}
+
+RPRUSD_TEXEL_TARGET("avx2")
+inline size_t RprUsd_ConvertUint16ToFloatAvx2(uint16_t const* src, float* dst, size_t count) {
+    const __m256 kScale = _mm256_set1_ps(1.0f / 65535.0f);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i ints = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(ints), kScale));
+    }
+    return i;
+}
+
+RPRUSD_TEXEL_TARGET("sse4.1")
+inline size_t RprUsd_ConvertUint16ToFloatSse4(uint16_t const* src, float* dst, size_t count) {
+    const __m128 kScale = _mm_set1_ps(1.0f / 65535.0f);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i ints = _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(src + i)));
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(ints), kScale));
+    }
+    return i;
+}
+
+RPRUSD_TEXEL_TARGET("avx2")
+inline size_t RprUsd_ConvertUint8ToFloatAvx2(uint8_t const* src, float* dst, size_t count) {
+    const __m256 kScale = _mm256_set1_ps(1.0f / 255.0f);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i ints = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(ints), kScale));
+    }
+    return i;
+}
+
+RPRUSD_TEXEL_TARGET("sse4.1")
+inline size_t RprUsd_ConvertUint8ToFloatSse4(uint8_t const* src, float* dst, size_t count) {
+    const __m128 kScale = _mm_set1_ps(1.0f / 255.0f);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        int32_t bytes;
+        std::memcpy(&bytes, src + i, sizeof(bytes));
+        __m128i ints = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes));
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(ints), kScale));
+    }
+    return i;
+}
+
+/// Gathers the first \p dstComponents bytes of RGBA8 texels
+RPRUSD_TEXEL_TARGET("sse4.1")
+inline size_t RprUsd_ExtractRgba8ComponentsSse4(uint8_t const* src, uint8_t* dst, uint32_t dstComponents, size_t numTexels) {
+    // Shuffle masks gather the first N bytes of four RGBA texels into the low bytes
+    __m128i mask;
+    if (dstComponents == 1) {
+        mask = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    } else if (dstComponents == 2) {
+        mask = _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1);
+    } else {
+        mask = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    }
+
+    // Every store writes 16 bytes while only 4 * dstComponents of them are
+    // results, stop early enough to not write past the end of dst
+    size_t dstSize = numTexels * dstComponents;
+    size_t i = 0;
+    for (; i + 4 <= numTexels && i * dstComponents + 16 <= dstSize; i += 4) {
+        __m128i texels = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i * 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * dstComponents), _mm_shuffle_epi8(texels, mask));
+    }
+    return i;
+}
+
+/// Gathers the first component of RGBA32F texels
+inline size_t RprUsd_ExtractRgba32fFirstComponentSse2(float const* src, float* dst, size_t numTexels) {
+    size_t i = 0;
+    for (; i + 4 <= numTexels; i += 4) {
+        __m128 t01 = _mm_shuffle_ps(_mm_loadu_ps(src + i * 4), _mm_loadu_ps(src + i * 4 + 4), _MM_SHUFFLE(0, 0, 0, 0));
+        __m128 t23 = _mm_shuffle_ps(_mm_loadu_ps(src + i * 4 + 8), _mm_loadu_ps(src + i * 4 + 12), _MM_SHUFFLE(0, 0, 0, 0));
+        _mm_storeu_ps(dst + i, _mm_shuffle_ps(t01, t23, _MM_SHUFFLE(2, 0, 2, 0)));
+    }
+    return i;
+}
+
+#endif // RPRUSD_TEXEL_X86
+
+inline void RprUsd_ConvertFloatToHalf(float const* src, uint16_t* dst, size_t count) {
+    size_t i = 0;
+#ifdef RPRUSD_TEXEL_X86
+    if (RprUsdGetTexelIsa().f16c) {
+        i = RprUsd_ConvertFloatToHalfF16c(src, dst, count);
+    }
+#endif // RPRUSD_TEXEL_X86
+    for (; i < count; ++i) {
+        dst[i] = GfHalf(src[i]).bits();
+    }
+}
+
+inline void RprUsd_ConvertHalfToFloat(uint16_t const* src, float* dst, size_t count) {
+    size_t i = 0;
+#ifdef RPRUSD_TEXEL_X86
+    if (RprUsdGetTexelIsa().f16c) {
+        i = RprUsd_ConvertHalfToFloatF16c(src, dst, count);
+    }
+#endif // RPRUSD_TEXEL_X86
+    for (; i < count; ++i) {
+        GfHalf h;
+        h.setBits(src[i]);
+        dst[i] = float(h);
+    }
+}
+
+/// Rounds to nearest: round(v * 255 / 65535) == (v + 128 - ((v + 128) >> 8)) >> 8, where
+/// (v + 128) >> 8 is computed as ((v >> 1) + 64) >> 7 to not overflow 16-bit lanes
+inline void RprUsd_ConvertUint16ToUint8(uint16_t const* src, uint8_t* dst, size_t count) {
+    size_t i = 0;
+#ifdef RPRUSD_TEXEL_X86
+    if (RprUsdGetTexelIsa().avx2) {
+        i = RprUsd_ConvertUint16ToUint8Avx2(src, dst, count);
+    }
+    i += RprUsd_ConvertUint16ToUint8Sse2(src + i, dst + i, count - i);
+#endif // RPRUSD_TEXEL_X86
+    for (; i < count; ++i) {
+        uint32_t v = src[i];
+        dst[i] = uint8_t((v + 128 - ((v + 128) >> 8)) >> 8);
+    }
+}
+
+inline void RprUsd_ConvertUint16ToFloat(uint16_t const* src, float* dst, size_t count) {
+    size_t i = 0;
+#ifdef RPRUSD_TEXEL_X86
+    if (RprUsdGetTexelIsa().avx2) {
+        i = RprUsd_ConvertUint16ToFloatAvx2(src, dst, count);
+    } else if (RprUsdGetTexelIsa().sse41) {
+        i = RprUsd_ConvertUint16ToFloatSse4(src, dst, count);
+    }
+#endif // RPRUSD_TEXEL_X86
+    for (; i < count; ++i) {
+        dst[i] = src[i] * (1.0f / 65535.0f);
+    }
+}
+
+/// Converts 8-bit components to float in [0, 1]. The data is not linearized,
+/// RPR decodes gamma of the resulting image as set by RprUsdGetImageGamma.
+inline void RprUsd_ConvertUint8ToFloat(uint8_t const* src, float* dst, size_t count) {
+    size_t i = 0;
+#ifdef RPRUSD_TEXEL_X86
+    if (RprUsdGetTexelIsa().avx2) {
+        i = RprUsd_ConvertUint8ToFloatAvx2(src, dst, count);
+    } else if (RprUsdGetTexelIsa().sse41) {
+        i = RprUsd_ConvertUint8ToFloatSse4(src, dst, count);
+    }
+#endif // RPRUSD_TEXEL_X86
+    for (; i < count; ++i) {
+        dst[i] = src[i] * (1.0f / 255.0f);
+    }
+}
+
+/// Copies the first \p dstComponents of every texel
+template <typename T>
+void RprUsd_ExtractComponents(T const* src, uint32_t srcComponents, T* dst, uint32_t dstComponents, size_t numTexels) {
+    size_t i = 0;
+#ifdef RPRUSD_TEXEL_X86
+    if (sizeof(T) == 1 && srcComponents == 4 && dstComponents < 4) {
+        if (RprUsdGetTexelIsa().sse41) {
+            i = RprUsd_ExtractRgba8ComponentsSse4(reinterpret_cast<uint8_t const*>(src), reinterpret_cast<uint8_t*>(dst), dstComponents, numTexels);
+        }
+    } else if (sizeof(T) == 4 && srcComponents == 4 && dstComponents == 1) {
+        i = RprUsd_ExtractRgba32fFirstComponentSse2(reinterpret_cast<float const*>(src), reinterpret_cast<float*>(dst), numTexels);
+    }
+#endif // RPRUSD_TEXEL_X86
+    for (; i < numTexels; ++i) {
+        for (uint32_t c = 0; c < dstComponents; ++c) {
+            dst[i * dstComponents + c] = src[i * srcComponents + c];
+        }
+    }
+}
+
+/// Converts \p numTexels texels from \p srcFormat to \p dstFormat. The destination
+/// may have fewer components and lower precision than the source. Values are
+/// not linearized, gamma is left to RPR. Returns false if the conversion is not supported.
+inline bool RprUsdConvertTexels(
+    void const* src, RprUsdTexelFormat const& srcFormat,
+    void* dst, RprUsdTexelFormat const& dstFormat,
+    size_t numTexels) {
+    if (dstFormat.numComponents == 0 || dstFormat.numComponents > srcFormat.numComponents) {
+        return false;
+    }
+
+    using Type = RprUsdTexelType;
+    auto srcType = srcFormat.type;
+    auto dstType = dstFormat.type;
+    bool isSupported =
+        srcType == dstType ||
+        (srcType == Type::kUint16 && dstType == Type::kUint8) ||
+        (srcType == Type::kUint16 && dstType == Type::kFloat16) ||
+        (srcType == Type::kFloat32 && dstType == Type::kFloat16) ||
+        (srcType == Type::kFloat16 && dstType == Type::kFloat32) ||
+        (srcType == Type::kUint8 && (dstType == Type::kFloat16 || dstType == Type::kFloat32));
+    if (!isSupported) {
+        return false;
+    }
+
+    if (srcType == dstType && srcFormat.numComponents == dstFormat.numComponents) {
+        std::memcpy(dst, src, numTexels * srcFormat.GetTexelSize());
+        return true;
+    }
+
+    // Work in chunks that fit into L2 together with the intermediate buffers
+    constexpr size_t kChunkSize = 4096;
+    std::vector<uint8_t> extracted;
+    std::vector<float> floats;
+
+    auto srcBytes = static_cast<uint8_t const*>(src);
+    auto dstBytes = static_cast<uint8_t*>(dst);
+    uint32_t numComponents = dstFormat.numComponents;
+
+    for (size_t offset = 0; offset < numTexels; offset += kChunkSize) {
+        size_t chunkTexels = std::min(kChunkSize, numTexels - offset);
+        size_t chunkComponents = chunkTexels * numComponents;
+
+        void const* chunkSrc = srcBytes + offset * srcFormat.GetTexelSize();
+        if (srcFormat.numComponents != numComponents) {
+            extracted.resize(chunkComponents * srcFormat.GetComponentSize());
+            switch (srcFormat.GetComponentSize()) {
+                case 1: RprUsd_ExtractComponents(static_cast<uint8_t const*>(chunkSrc), srcFormat.numComponents, extracted.data(), numComponents, chunkTexels); break;
+                case 2: RprUsd_ExtractComponents(static_cast<uint16_t const*>(chunkSrc), srcFormat.numComponents, reinterpret_cast<uint16_t*>(extracted.data()), numComponents, chunkTexels); break;
+                default: RprUsd_ExtractComponents(static_cast<float const*>(chunkSrc), srcFormat.numComponents, reinterpret_cast<float*>(extracted.data()), numComponents, chunkTexels); break;
+            }
+            chunkSrc = extracted.data();
+        }
+
+        void* chunkDst = dstBytes + offset * dstFormat.GetTexelSize();
+        if (srcType == dstType) {
+            std::memcpy(chunkDst, chunkSrc, chunkComponents * dstFormat.GetComponentSize());
+        } else if (srcType == Type::kUint16 && dstType == Type::kUint8) {
+            RprUsd_ConvertUint16ToUint8(static_cast<uint16_t const*>(chunkSrc), static_cast<uint8_t*>(chunkDst), chunkComponents);
+        } else if (srcType == Type::kUint16) {
+            floats.resize(chunkComponents);
+            RprUsd_ConvertUint16ToFloat(static_cast<uint16_t const*>(chunkSrc), floats.data(), chunkComponents);
+            RprUsd_ConvertFloatToHalf(floats.data(), static_cast<uint16_t*>(chunkDst), chunkComponents);
+        } else if (srcType == Type::kFloat32) {
+            RprUsd_ConvertFloatToHalf(static_cast<float const*>(chunkSrc), static_cast<uint16_t*>(chunkDst), chunkComponents);
+        } else if (srcType == Type::kFloat16) {
+            RprUsd_ConvertHalfToFloat(static_cast<uint16_t const*>(chunkSrc), static_cast<float*>(chunkDst), chunkComponents);
+        } else if (dstType == Type::kFloat32) {
+            RprUsd_ConvertUint8ToFloat(static_cast<uint8_t const*>(chunkSrc), static_cast<float*>(chunkDst), chunkComponents);
+        } else {
+            floats.resize(chunkComponents);
+            RprUsd_ConvertUint8ToFloat(static_cast<uint8_t const*>(chunkSrc), floats.data(), chunkComponents);
+            RprUsd_ConvertFloatToHalf(floats.data(), static_cast<uint16_t*>(chunkDst), chunkComponents);
+        }
+    }
+
+    return true;
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_TEXEL_CONVERSION_H
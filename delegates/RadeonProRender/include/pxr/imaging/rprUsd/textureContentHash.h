@@ -0,0 +1,117 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_TEXTURE_CONTENT_HASH_H
+#define PXR_IMAGING_RPR_USD_TEXTURE_CONTENT_HASH_H
+
+#include "pxr/pxr.h"
+#include "pxr/base/arch/fileSystem.h"
+#include "pxr/base/arch/hash.h"
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdTextureContentHasher
+///
+/// Hashes the bytes of texture files. Hashes are memoized together with the
+/// modification time and size of the file, so every file is read only once
+/// until it changes. Thread-safe; files are hashed outside of the lock.
+///
+class RprUsdTextureContentHasher {
+public:
+    /// Returns false if \p filepath can not be read
+    bool GetHash(std::string const& filepath, uint64_t* hash);
+
+    /// Compares the bytes of two files, meant to confirm equal hashes.
+    /// Returns false if either file can not be read.
+    static bool AreFilesEqual(std::string const& lhs, std::string const& rhs);
+
+    void Clear() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_hashes.clear();
+    }
+
+private:
+    struct Entry {
+        double modificationTime;
+        int64_t size;
+        uint64_t hash;
+    };
+
+    std::mutex m_mutex;
+    std::unordered_map<std::string, Entry> m_hashes;
+};
+
+inline bool RprUsdTextureContentHasher::GetHash(std::string const& filepath, uint64_t* hash) {
+    double modificationTime;
+    if (!ArchGetModificationTime(filepath.c_str(), &modificationTime)) {
+        return false;
+    }
+    int64_t size = ArchGetFileLength(filepath.c_str());
+    if (size < 0) {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_hashes.find(filepath);
+        if (it != m_hashes.end() &&
+            it->second.modificationTime == modificationTime &&
+            it->second.size == size) {
+            *hash = it->second.hash;
+            return true;
+        }
+    }
+
+    auto mapping = ArchMapFileReadOnly(filepath);
+    if (!mapping) {
+        return false;
+    }
+    size_t length = ArchGetFileMappingLength(mapping);
+    // File size is part of the hash so that a zero-length file does not collide with the seed
+    uint64_t contentHash = ArchHash64(mapping.get(), length, uint64_t(length));
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_hashes[filepath] = Entry{modificationTime, size, contentHash};
+    *hash = contentHash;
+    return true;
+}
+
+inline bool RprUsdTextureContentHasher::AreFilesEqual(std::string const& lhs, std::string const& rhs) {
+    if (lhs == rhs) {
+        return true;
+    }
+
+    int64_t size = ArchGetFileLength(lhs.c_str());
+    if (size < 0 || size != ArchGetFileLength(rhs.c_str())) {
+        return false;
+    }
+
+    auto lhsMapping = ArchMapFileReadOnly(lhs);
+    auto rhsMapping = ArchMapFileReadOnly(rhs);
+    if (!lhsMapping || !rhsMapping) {
+        return false;
+    }
+    size_t length = ArchGetFileMappingLength(lhsMapping);
+    return length == ArchGetFileMappingLength(rhsMapping) &&
+        std::memcmp(lhsMapping.get(), rhsMapping.get(), length) == 0;
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_TEXTURE_CONTENT_HASH_H
@@ -0,0 +1,269 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_TEXTURE_DATA_POOL_H
+#define PXR_IMAGING_RPR_USD_TEXTURE_DATA_POOL_H
+
+#include "pxr/imaging/rprUsd/texelConversion.h"
+#include "pxr/imaging/rprUsd/util.h"
+#include "pxr/base/arch/fileSystem.h"
+#include "pxr/base/tf/getenv.h"
+
+#include <exception>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdTextureDataPool
+///
+/// Pool of decoded textures shared by the render sessions of one module, so that
+/// sessions that use it decode each file once. The instance is a function-local
+/// static of this header, so every shared library that includes it has its own
+/// pool. RprUsdImageCache and the texture loading of RprUsdMaterialRegistry do
+/// not read from it. Entries are keyed by filepath and modification time.
+///
+/// Decoded data is reference counted: the pool hands out shared pointers and
+/// remembers them weakly. Concurrent requests for a file that is being decoded
+/// wait for that decode instead of starting their own. Additionally, up to
+/// RPRUSD_TEXTURE_DATA_POOL_BUDGET_MB megabytes of recently decoded data is kept
+/// alive so that sessions that start later still hit the pool. The budget is 0
+/// by default: nothing is retained beyond the data in use.
+///
+class RprUsdTextureDataPool {
+public:
+    struct Stats {
+        size_t numHits = 0;
+        size_t numDecodes = 0;
+        size_t numInFlightWaits = 0;
+        size_t retainedBytes = 0;
+    };
+
+    static RprUsdTextureDataPool& GetInstance() {
+        static RprUsdTextureDataPool instance;
+        return instance;
+    }
+
+    /// Decoded texture data of \p filepath, decodes it if no up-to-date data is in the pool
+    std::shared_ptr<RprUsdTextureData> Get(std::string const& filepath);
+
+    void SetByteBudget(size_t byteBudget);
+
+    /// Releases data retained by the pool, data in use stays alive
+    void Clear();
+
+    Stats GetStats() const;
+
+private:
+    RprUsdTextureDataPool() {
+        int budgetMb = TfGetenvInt("RPRUSD_TEXTURE_DATA_POOL_BUDGET_MB", 0);
+        m_byteBudget = budgetMb > 0 ? size_t(budgetMb) << 20 : 0;
+    }
+
+    using Future = std::shared_future<std::shared_ptr<RprUsdTextureData>>;
+
+    struct RetainedData {
+        std::string filepath;
+        std::shared_ptr<RprUsdTextureData> data;
+        size_t numBytes;
+    };
+    using RetainedList = std::list<RetainedData>;
+
+    struct Entry {
+        double modificationTime = 0.0;
+        std::weak_ptr<RprUsdTextureData> data;
+        Future pending;
+        uint64_t generation = 0;
+        RetainedList::iterator retained;
+        bool isRetained = false;
+    };
+
+    static size_t GetByteSize(RprUsdTextureData const& data);
+    void Retain(Entry* entry, std::string const& filepath, std::shared_ptr<RprUsdTextureData> const& data);
+    void Release(Entry* entry);
+    void Evict();
+
+private:
+    mutable std::mutex m_mutex;
+    std::unordered_map<std::string, Entry> m_entries;
+    uint64_t m_nextGeneration = 1;
+    size_t m_sweepThreshold = 64;
+
+    // Front is the most recently used data
+    RetainedList m_retained;
+    size_t m_retainedBytes = 0;
+    size_t m_byteBudget;
+
+    size_t m_numHits = 0;
+    size_t m_numDecodes = 0;
+    size_t m_numInFlightWaits = 0;
+};
+
+inline std::shared_ptr<RprUsdTextureData> RprUsdTextureDataPool::Get(std::string const& filepath) {
+    double modificationTime;
+    if (!ArchGetModificationTime(filepath.c_str(), &modificationTime)) {
+        // Let RprUsdTextureData report the error
+        return RprUsdTextureData::New(filepath);
+    }
+
+    std::promise<std::shared_ptr<RprUsdTextureData>> promise;
+    uint64_t generation;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        auto it = m_entries.find(filepath);
+        if (it != m_entries.end() && it->second.modificationTime == modificationTime) {
+            auto& entry = it->second;
+            if (auto data = entry.data.lock()) {
+                ++m_numHits;
+                if (entry.isRetained) {
+                    m_retained.splice(m_retained.begin(), m_retained, entry.retained);
+                }
+                return data;
+            }
+            if (entry.pending.valid()) {
+                ++m_numInFlightWaits;
+                auto pending = entry.pending;
+                lock.unlock();
+                return pending.get();
+            }
+        }
+
+        if (m_entries.size() >= m_sweepThreshold) {
+            for (auto entryIt = m_entries.begin(); entryIt != m_entries.end();) {
+                if (entryIt->second.data.expired() && !entryIt->second.pending.valid()) {
+                    entryIt = m_entries.erase(entryIt);
+                } else {
+                    ++entryIt;
+                }
+            }
+            m_sweepThreshold = std::max<size_t>(64, m_entries.size() * 2);
+        }
+
+        auto& entry = m_entries[filepath];
+        Release(&entry);
+        entry.modificationTime = modificationTime;
+        entry.data.reset();
+        entry.pending = promise.get_future().share();
+        entry.generation = generation = m_nextGeneration++;
+        ++m_numDecodes;
+    }
+
+    std::shared_ptr<RprUsdTextureData> data;
+    try {
+        data = RprUsdTextureData::New(filepath);
+    } catch (...) {
+        // Waiters get the same exception, later requests decode again
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_entries.find(filepath);
+            if (it != m_entries.end() && it->second.generation == generation) {
+                Release(&it->second);
+                m_entries.erase(it);
+            }
+        }
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(filepath);
+        // The file might have been modified and requested again meanwhile
+        if (it != m_entries.end() && it->second.generation == generation) {
+            auto& entry = it->second;
+            entry.pending = Future();
+            entry.data = data;
+            if (data) {
+                Retain(&entry, filepath, data);
+            }
+        }
+    }
+
+    promise.set_value(data);
+    return data;
+}
+
+inline size_t RprUsdTextureDataPool::GetByteSize(RprUsdTextureData const& data) {
+    RprUsdTexelFormat format;
+    if (!RprUsdGetTexelFormat(data, &format)) {
+        return 0;
+    }
+    return size_t(data.GetWidth()) * data.GetHeight() * format.GetTexelSize();
+}
+
+inline void RprUsdTextureDataPool::Retain(Entry* entry, std::string const& filepath, std::shared_ptr<RprUsdTextureData> const& data) {
+    size_t numBytes = GetByteSize(*data);
+    if (!m_byteBudget || numBytes > m_byteBudget) {
+        return;
+    }
+
+    m_retained.push_front(RetainedData{filepath, data, numBytes});
+    m_retainedBytes += numBytes;
+    entry->retained = m_retained.begin();
+    entry->isRetained = true;
+    Evict();
+}
+
+inline void RprUsdTextureDataPool::Release(Entry* entry) {
+    if (entry->isRetained) {
+        m_retainedBytes -= entry->retained->numBytes;
+        m_retained.erase(entry->retained);
+        entry->isRetained = false;
+    }
+}
+
+inline void RprUsdTextureDataPool::Evict() {
+    while (m_retainedBytes > m_byteBudget && !m_retained.empty()) {
+        auto it = m_entries.find(m_retained.back().filepath);
+        if (it != m_entries.end()) {
+            Release(&it->second);
+        } else {
+            m_retainedBytes -= m_retained.back().numBytes;
+            m_retained.pop_back();
+        }
+    }
+}
+
+inline void RprUsdTextureDataPool::SetByteBudget(size_t byteBudget) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_byteBudget = byteBudget;
+    Evict();
+}
+
+inline void RprUsdTextureDataPool::Clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& entry : m_entries) {
+        entry.second.isRetained = false;
+    }
+    m_retained.clear();
+    m_retainedBytes = 0;
+}
+
+inline RprUsdTextureDataPool::Stats RprUsdTextureDataPool::GetStats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats stats;
+    stats.numHits = m_numHits;
+    stats.numDecodes = m_numDecodes;
+    stats.numInFlightWaits = m_numInFlightWaits;
+    stats.retainedBytes = m_retainedBytes;
+    return stats;
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_TEXTURE_DATA_POOL_H
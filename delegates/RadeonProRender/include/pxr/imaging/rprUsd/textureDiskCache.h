@@ -0,0 +1,382 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_TEXTURE_DISK_CACHE_H
+#define PXR_IMAGING_RPR_USD_TEXTURE_DISK_CACHE_H
+
+#include "pxr/imaging/rprUsd/configSnapshot.h"
+#include "pxr/imaging/rprUsd/coreImage.h"
+#include "pxr/imaging/rprUsd/texelConversion.h"
+#include "pxr/imaging/rprUsd/textureDataPool.h"
+#include "pxr/imaging/rprUsd/util.h"
+#include "pxr/base/arch/fileSystem.h"
+#include "pxr/base/arch/hash.h"
+#include "pxr/base/gf/half.h"
+#include "pxr/base/tf/fileUtils.h"
+#include "pxr/base/tf/stringUtils.h"
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdTextureDiskCache
+///
+/// Persistent cache of decoded textures. Each entry holds the texel data of one
+/// source image already converted to the rpr::ImageFormat it is uploaded with,
+/// together with its full mip chain, and is memory-mapped on lookup so that
+/// a warm start does not decode the source file at all.
+///
+/// Texels are narrowed to the number of components required. Entries consumed
+/// by single-channel inputs (roughness, masks, etc.) are stored with reduced
+/// precision: 32-bit floats as half floats and 16-bit integers as 8-bit.
+///
+/// Entries are content-addressed by the source path, its modification time,
+/// colorspace and the number of components required. Stale entries are never
+/// matched and are left for RprUsdTextureDiskCache::Clear or the
+/// "Clear Texture Cache" usdview menu action, which removes "*.rprtex" files.
+/// There is no automatic eviction.
+///
+class RprUsdTextureDiskCache {
+    static constexpr uint32_t kMaxLevels = 32;
+    static constexpr uint32_t kVersion = 3;
+    static constexpr uint64_t kDataAlignment = 64;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t numComponents;
+        uint32_t componentType;
+        uint32_t numLevels;
+        // Gamma of the image loaded without the cache. Narrowing to the stored
+        // format may change the component type, e.g. 16-bit data to 8-bit
+        float gamma;
+        struct LevelDesc {
+            uint32_t width;
+            uint32_t height;
+            uint64_t offset;
+            uint64_t size;
+        } levels[kMaxLevels];
+    };
+    static const char* GetMagic() { return "RPRTEX1"; }
+
+public:
+    struct Level {
+        uint32_t width;
+        uint32_t height;
+        void const* data;
+    };
+
+    class MappedTexture {
+    public:
+        rpr::ImageFormat GetFormat() const { return {m_header->numComponents, m_header->componentType}; }
+        uint32_t GetNumLevels() const { return m_header->numLevels; }
+        float GetGamma() const { return m_header->gamma; }
+        Level GetLevel(uint32_t level) const {
+            auto& desc = m_header->levels[level];
+            return {desc.width, desc.height, m_mapping.get() + desc.offset};
+        }
+
+    private:
+        friend class RprUsdTextureDiskCache;
+
+        ArchConstFileMapping m_mapping;
+        FileHeader const* m_header;
+    };
+
+    /// Default directory is RprUsdConfig's texture cache directory
+    static std::string GetDefaultCacheDir() {
+        return RprUsdConfigSnapshot::GetLatest().textureCacheDir;
+    }
+
+    explicit RprUsdTextureDiskCache(std::string cacheDir = GetDefaultCacheDir())
+        : m_cacheDir(std::move(cacheDir)) {}
+
+    std::string const& GetCacheDir() const { return m_cacheDir; }
+
+    /// Maps cached texel data of \p filepath if an up-to-date entry exists
+    std::shared_ptr<MappedTexture> Find(std::string const& filepath, std::string const& colorspace, uint32_t numComponentsRequired) const;
+
+    /// Converts \p textureData to the most compact rpr::ImageFormat suitable for the consuming input,
+    /// builds mip chain and writes it to the cache
+    bool Store(std::string const& filepath, std::string const& colorspace, uint32_t numComponentsRequired, RprUsdTextureData const& textureData) const;
+
+    /// Looks up \p filepath in the cache, decodes and stores it on miss
+    std::shared_ptr<MappedTexture> FindOrCreate(std::string const& filepath, std::string const& colorspace, uint32_t numComponentsRequired) const;
+
+    /// Creates RPR image from \p level of \p texture, the base level by default
+    static RprUsdCoreImage* CreateImage(rpr::Context* context, MappedTexture const& texture, rpr::ImageWrapType wrapType, uint32_t level = 0);
+
+    /// Removes all cache entries
+    size_t Clear() const;
+
+private:
+    static const char* GetFileExtension() { return ".rprtex"; }
+
+    std::string GetEntryPath(std::string const& filepath, std::string const& colorspace, uint32_t numComponentsRequired) const;
+
+    template <typename T, typename Average>
+    static void Downsample(uint8_t const* src, uint32_t srcWidth, uint32_t srcHeight, uint8_t* dst, uint32_t numComponents, Average&& average);
+
+private:
+    std::string m_cacheDir;
+};
+
+inline std::string RprUsdTextureDiskCache::GetEntryPath(
+    std::string const& filepath,
+    std::string const& colorspace,
+    uint32_t numComponentsRequired) const {
+    double modificationTime = 0.0;
+    if (!ArchGetModificationTime(filepath.c_str(), &modificationTime)) {
+        return {};
+    }
+
+    auto keyString = TfStringPrintf("%s|%.17g|%s|%u", filepath.c_str(), modificationTime, colorspace.c_str(), numComponentsRequired);
+    uint64_t hash = ArchHash64(keyString.c_str(), keyString.size());
+    return TfStringPrintf("%s/%016llx%s", m_cacheDir.c_str(), (unsigned long long)hash, GetFileExtension());
+}
+
+inline std::shared_ptr<RprUsdTextureDiskCache::MappedTexture> RprUsdTextureDiskCache::Find(
+    std::string const& filepath,
+    std::string const& colorspace,
+    uint32_t numComponentsRequired) const {
+    auto entryPath = GetEntryPath(filepath, colorspace, numComponentsRequired);
+    if (entryPath.empty() || !TfIsFile(entryPath)) {
+        return nullptr;
+    }
+
+    auto texture = std::make_shared<MappedTexture>();
+    texture->m_mapping = ArchMapFileReadOnly(entryPath);
+    if (!texture->m_mapping) {
+        return nullptr;
+    }
+
+    size_t mappingSize = ArchGetFileMappingLength(texture->m_mapping);
+    if (mappingSize < sizeof(FileHeader)) {
+        return nullptr;
+    }
+
+    auto header = reinterpret_cast<FileHeader const*>(texture->m_mapping.get());
+    if (std::memcmp(header->magic, GetMagic(), sizeof(header->magic)) != 0 ||
+        header->version != kVersion ||
+        header->numLevels == 0 || header->numLevels > kMaxLevels) {
+        return nullptr;
+    }
+    for (uint32_t i = 0; i < header->numLevels; ++i) {
+        if (header->levels[i].offset + header->levels[i].size > mappingSize) {
+            TF_WARN("Truncated texture cache entry: %s", entryPath.c_str());
+            return nullptr;
+        }
+    }
+
+    texture->m_header = header;
+    return texture;
+}
+
+template <typename T, typename Average>
+void RprUsdTextureDiskCache::Downsample(
+    uint8_t const* src, uint32_t srcWidth, uint32_t srcHeight,
+    uint8_t* dst, uint32_t numComponents, Average&& average) {
+    uint32_t dstWidth = std::max(srcWidth / 2, 1u);
+    uint32_t dstHeight = std::max(srcHeight / 2, 1u);
+
+    auto srcTexels = reinterpret_cast<T const*>(src);
+    auto dstTexels = reinterpret_cast<T*>(dst);
+    for (uint32_t y = 0; y < dstHeight; ++y) {
+        uint32_t y0 = std::min(y * 2, srcHeight - 1);
+        uint32_t y1 = std::min(y * 2 + 1, srcHeight - 1);
+        for (uint32_t x = 0; x < dstWidth; ++x) {
+            uint32_t x0 = std::min(x * 2, srcWidth - 1);
+            uint32_t x1 = std::min(x * 2 + 1, srcWidth - 1);
+            for (uint32_t c = 0; c < numComponents; ++c) {
+                dstTexels[(y * dstWidth + x) * numComponents + c] = average(
+                    srcTexels[(y0 * srcWidth + x0) * numComponents + c],
+                    srcTexels[(y0 * srcWidth + x1) * numComponents + c],
+                    srcTexels[(y1 * srcWidth + x0) * numComponents + c],
+                    srcTexels[(y1 * srcWidth + x1) * numComponents + c]);
+            }
+        }
+    }
+}
+
+inline bool RprUsdTextureDiskCache::Store(
+    std::string const& filepath,
+    std::string const& colorspace,
+    uint32_t numComponentsRequired,
+    RprUsdTextureData const& textureData) const {
+    RprUsdTexelFormat srcFormat;
+    if (!RprUsdGetTexelFormat(textureData, &srcFormat)) {
+        return false;
+    }
+
+    bool reducePrecision = numComponentsRequired == 1;
+    auto texelFormat = RprUsdChooseTexelFormat(srcFormat, numComponentsRequired, reducePrecision);
+    rpr::ImageFormat format;
+    if (!RprUsdGetImageFormat(texelFormat, &format)) {
+        return false;
+    }
+
+    // Format the source would be uploaded with if it was not cached
+    rpr::ImageFormat uncachedFormat;
+    if (!RprUsdGetImageFormat(RprUsdChooseTexelFormat(srcFormat, 0, false), &uncachedFormat)) {
+        return false;
+    }
+
+    auto entryPath = GetEntryPath(filepath, colorspace, numComponentsRequired);
+    if (entryPath.empty() || !TfMakeDirs(m_cacheDir, -1, true)) {
+        return false;
+    }
+
+    size_t pixelSize = texelFormat.GetTexelSize();
+
+    FileHeader header = {};
+    std::memcpy(header.magic, GetMagic(), sizeof(header.magic));
+    header.version = kVersion;
+    header.numComponents = format.num_components;
+    header.componentType = format.type;
+    header.gamma = RprUsdGetImageGamma(colorspace, uncachedFormat);
+
+    uint32_t width = uint32_t(textureData.GetWidth());
+    uint32_t height = uint32_t(textureData.GetHeight());
+    uint64_t offset = (sizeof(FileHeader) + kDataAlignment - 1) & ~uint64_t(kDataAlignment - 1);
+    for (header.numLevels = 0; header.numLevels < kMaxLevels; ++header.numLevels) {
+        auto& level = header.levels[header.numLevels];
+        level.width = width;
+        level.height = height;
+        level.offset = offset;
+        level.size = uint64_t(width) * height * pixelSize;
+        offset = (offset + level.size + kDataAlignment - 1) & ~uint64_t(kDataAlignment - 1);
+
+        if (width == 1 && height == 1) {
+            ++header.numLevels;
+            break;
+        }
+        width = std::max(width / 2, 1u);
+        height = std::max(height / 2, 1u);
+    }
+
+    std::vector<uint8_t> levelData(header.levels[0].size);
+    size_t numTexels = size_t(header.levels[0].width) * header.levels[0].height;
+    if (!RprUsdConvertTexels(textureData.GetData(), srcFormat, levelData.data(), texelFormat, numTexels)) {
+        return false;
+    }
+
+    // Write into a unique temporary file first so that concurrent writers and readers never observe partial entries.
+    // ArchMakeTmpFile picks a name no other thread or process uses.
+    std::string tmpPath;
+    int tmpFile = ArchMakeTmpFile(m_cacheDir, TfGetBaseName(entryPath), &tmpPath);
+    if (tmpFile == -1) {
+        return false;
+    }
+    ArchCloseFile(tmpFile);
+    FILE* file = ArchOpenFile(tmpPath.c_str(), "wb");
+    if (!file) {
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+
+    // Levels are written sequentially, padding up to the aligned offset of each level
+    uint64_t fileOffset = 0;
+    auto writeAt = [file, &fileOffset](uint64_t offset, void const* data, size_t size) {
+        static const uint8_t kPadding[kDataAlignment] = {};
+        if (offset > fileOffset && std::fwrite(kPadding, 1, size_t(offset - fileOffset), file) != offset - fileOffset) {
+            return false;
+        }
+        fileOffset = offset + size;
+        return std::fwrite(data, 1, size, file) == size;
+    };
+
+    bool success = writeAt(0, &header, sizeof(header));
+    std::vector<uint8_t> nextLevelData;
+    for (uint32_t i = 0; success && i < header.numLevels; ++i) {
+        auto& level = header.levels[i];
+        success = writeAt(level.offset, levelData.data(), levelData.size());
+
+        if (success && i + 1 < header.numLevels) {
+            nextLevelData.resize(header.levels[i + 1].size);
+            if (format.type == RPR_COMPONENT_TYPE_FLOAT32) {
+                Downsample<float>(levelData.data(), level.width, level.height, nextLevelData.data(), format.num_components,
+                    [](float a, float b, float c, float d) { return (a + b + c + d) * 0.25f; });
+            } else if (format.type == RPR_COMPONENT_TYPE_FLOAT16) {
+                Downsample<GfHalf>(levelData.data(), level.width, level.height, nextLevelData.data(), format.num_components,
+                    [](GfHalf a, GfHalf b, GfHalf c, GfHalf d) { return GfHalf((float(a) + float(b) + float(c) + float(d)) * 0.25f); });
+            } else if (format.type == RPR_COMPONENT_TYPE_UINT8) {
+                Downsample<uint8_t>(levelData.data(), level.width, level.height, nextLevelData.data(), format.num_components,
+                    [](uint32_t a, uint32_t b, uint32_t c, uint32_t d) { return uint8_t((a + b + c + d + 2) / 4); });
+            } else {
+                success = false;
+            }
+            levelData.swap(nextLevelData);
+        }
+    }
+    success = std::fclose(file) == 0 && success;
+
+    if (success && std::rename(tmpPath.c_str(), entryPath.c_str()) == 0) {
+        return true;
+    }
+
+    // Entry might have been written by another process in the meantime
+    std::remove(tmpPath.c_str());
+    return TfIsFile(entryPath);
+}
+
+inline std::shared_ptr<RprUsdTextureDiskCache::MappedTexture> RprUsdTextureDiskCache::FindOrCreate(
+    std::string const& filepath,
+    std::string const& colorspace,
+    uint32_t numComponentsRequired) const {
+    if (auto texture = Find(filepath, colorspace, numComponentsRequired)) {
+        return texture;
+    }
+
+    auto textureData = RprUsdTextureDataPool::GetInstance().Get(filepath);
+    if (!textureData || !Store(filepath, colorspace, numComponentsRequired, *textureData)) {
+        return nullptr;
+    }
+
+    return Find(filepath, colorspace, numComponentsRequired);
+}
+
+inline RprUsdCoreImage* RprUsdTextureDiskCache::CreateImage(
+    rpr::Context* context,
+    MappedTexture const& texture,
+    rpr::ImageWrapType wrapType,
+    uint32_t level) {
+    auto format = texture.GetFormat();
+    auto levelData = texture.GetLevel(std::min(level, texture.GetNumLevels() - 1));
+    auto image = RprUsdCoreImage::Create(context, levelData.width, levelData.height, format, levelData.data);
+    if (!image) {
+        return nullptr;
+    }
+
+    image->SetGamma(texture.GetGamma());
+    image->SetWrap(wrapType);
+    image->SetMipmapEnabled(true);
+    return image;
+}
+
+inline size_t RprUsdTextureDiskCache::Clear() const {
+    size_t numFilesRemoved = 0;
+    for (auto& filename : TfListDir(m_cacheDir)) {
+        if (TfStringEndsWith(filename, GetFileExtension()) && TfDeleteFile(filename)) {
+            ++numFilesRemoved;
+        }
+    }
+    return numFilesRemoved;
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_TEXTURE_DISK_CACHE_H
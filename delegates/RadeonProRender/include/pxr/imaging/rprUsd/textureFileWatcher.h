@@ -0,0 +1,476 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_TEXTURE_FILE_WATCHER_H
+#define PXR_IMAGING_RPR_USD_TEXTURE_FILE_WATCHER_H
+
+#include "pxr/pxr.h"
+#include "pxr/base/arch/defines.h"
+#include "pxr/base/arch/errno.h"
+#include "pxr/base/arch/fileSystem.h"
+#include "pxr/base/tf/diagnostic.h"
+#include "pxr/base/tf/getenv.h"
+#include "pxr/base/tf/pathUtils.h"
+#include "pxr/base/tf/stringUtils.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef ARCH_OS_LINUX
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif // ARCH_OS_LINUX
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdTextureFileWatcher
+///
+/// Detects modification of texture files on a background thread so that texture
+/// lookups do not have to stat the files themselves. On Linux the parent
+/// directories of watched files are watched with inotify. For symlinks both the
+/// directory of the link and the directory of its target are watched, so that
+/// replacing the link and editing the target are both detected. Elsewhere, or when
+/// RPRUSD_TEXTURE_WATCHER_POLL is set (inotify does not see changes made by other
+/// hosts on network file systems), all watched files are stat'ed every
+/// RPRUSD_TEXTURE_WATCHER_POLL_INTERVAL_MS milliseconds. Files whose directory
+/// can not be watched with inotify (e.g. the watch limit is reached or the
+/// directory is not readable) are polled the same way. When a watched directory
+/// is removed, its files are polled until the directory exists again and is
+/// watched anew. If the inotify queue overflows, events are lost and all
+/// watched files are reported as modified.
+///
+/// Listeners are invoked on the watcher thread with the key a file was watched under.
+/// Once RemoveListener returns the listener is guaranteed to not be running, so
+/// listeners must not add or remove listeners themselves.
+///
+class RprUsdTextureFileWatcher {
+public:
+    using Listener = std::function<void(std::string const& key)>;
+
+    RprUsdTextureFileWatcher();
+    ~RprUsdTextureFileWatcher();
+
+    RprUsdTextureFileWatcher(RprUsdTextureFileWatcher const&) = delete;
+    RprUsdTextureFileWatcher& operator=(RprUsdTextureFileWatcher const&) = delete;
+
+    /// Starts watching \p filepath, modification is reported with \p key.
+    /// Several files may share one key, e.g. all tiles of a UDIM texture.
+    void Watch(std::string const& filepath, std::string const& key);
+
+    /// Stops watching all files registered under \p key. Keys are shared by all
+    /// users of the watcher, users that unwatch files should keep their keys distinct.
+    void Unwatch(std::string const& key);
+
+    size_t AddListener(Listener listener);
+    void RemoveListener(size_t listenerId);
+
+    bool IsUsingInotify() const { return m_inotifyFd >= 0; }
+
+private:
+    // (watch descriptor, file name)
+    using WatchEntry = std::pair<int, std::string>;
+
+    struct WatchedFile {
+        std::set<std::string> keys;
+        double modificationTime = 0.0;
+        std::vector<WatchEntry> watchEntries;
+        // Stat'ed every poll interval because inotify can not watch it
+        bool isPolled = true;
+        // The directory is missing or its watch was removed, watching is retried every poll
+        bool needsRewatch = false;
+    };
+
+    void Notify(std::string const& filepath);
+    /// Checks modification times of all watched files, or only of those that
+    /// inotify can not watch if \p polledOnly. Must be called without m_mutex held.
+    void PollFiles(bool polledOnly);
+    /// Notifies about files whose modification time differs from the given one
+    void CheckFiles(std::vector<std::pair<std::string, double>> const& files);
+    void PollLoop();
+#ifdef ARCH_OS_LINUX
+    /// Watches the directories of \p filepath and of its symlink target.
+    /// Must be called with m_mutex held.
+    void UpdateWatchEntries(std::string const& filepath, WatchedFile* file);
+    void RemoveWatchEntries(std::string const& filepath, WatchedFile* file);
+    /// Forgets the watch \p wd the kernel has removed (IN_IGNORED), e.g. because its
+    /// directory was deleted, and adds the files watched through it to \p files
+    void OnWatchRemoved(int wd, std::set<std::string>* files);
+    void RewatchFiles();
+    void InotifyLoop();
+#endif // ARCH_OS_LINUX
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_stopCondition;
+    bool m_stop = false;
+
+    std::map<std::string, WatchedFile> m_files;
+    // Held while listeners run so that removal waits for in-flight notifications
+    std::mutex m_listenerMutex;
+    std::map<size_t, Listener> m_listeners;
+    size_t m_nextListenerId = 0;
+
+    int m_inotifyFd = -1;
+    std::map<std::string, int> m_watchByDirectory;
+    // Watch entry -> watched filepaths, a symlink target may be watched through several links
+    std::map<WatchEntry, std::set<std::string>> m_filesByWatchEntry;
+
+    std::chrono::milliseconds m_pollInterval;
+    std::thread m_thread;
+};
+
+inline RprUsdTextureFileWatcher::RprUsdTextureFileWatcher()
+    : m_pollInterval(std::max(TfGetenvInt("RPRUSD_TEXTURE_WATCHER_POLL_INTERVAL_MS", 2000), 100)) {
+#ifdef ARCH_OS_LINUX
+    if (!TfGetenvBool("RPRUSD_TEXTURE_WATCHER_POLL", false)) {
+        m_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (m_inotifyFd < 0) {
+            TF_WARN("Failed to initialize inotify, falling back to texture file polling");
+        }
+    }
+    if (m_inotifyFd >= 0) {
+        m_thread = std::thread([this]() { InotifyLoop(); });
+        return;
+    }
+#endif // ARCH_OS_LINUX
+    m_thread = std::thread([this]() { PollLoop(); });
+}
+
+inline RprUsdTextureFileWatcher::~RprUsdTextureFileWatcher() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_stopCondition.notify_all();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+#ifdef ARCH_OS_LINUX
+    if (m_inotifyFd >= 0) {
+        close(m_inotifyFd);
+    }
+#endif // ARCH_OS_LINUX
+}
+
+inline void RprUsdTextureFileWatcher::Watch(std::string const& filepath, std::string const& key) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto status = m_files.emplace(filepath, WatchedFile{});
+    status.first->second.keys.insert(key);
+    if (!status.second) {
+#ifdef ARCH_OS_LINUX
+        if (m_inotifyFd >= 0 && status.first->second.needsRewatch) {
+            UpdateWatchEntries(filepath, &status.first->second);
+        }
+#endif // ARCH_OS_LINUX
+        return;
+    }
+    ArchGetModificationTime(filepath.c_str(), &status.first->second.modificationTime);
+
+#ifdef ARCH_OS_LINUX
+    if (m_inotifyFd >= 0) {
+        UpdateWatchEntries(filepath, &status.first->second);
+    }
+#endif // ARCH_OS_LINUX
+}
+
+inline void RprUsdTextureFileWatcher::Unwatch(std::string const& key) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // Directory watches are kept, they are cheap and likely to be reused by other textures
+    for (auto it = m_files.begin(); it != m_files.end();) {
+        it->second.keys.erase(key);
+        if (it->second.keys.empty()) {
+#ifdef ARCH_OS_LINUX
+            RemoveWatchEntries(it->first, &it->second);
+#endif // ARCH_OS_LINUX
+            it = m_files.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+inline size_t RprUsdTextureFileWatcher::AddListener(Listener listener) {
+    std::lock_guard<std::mutex> lock(m_listenerMutex);
+    auto listenerId = m_nextListenerId++;
+    m_listeners.emplace(listenerId, std::move(listener));
+    return listenerId;
+}
+
+inline void RprUsdTextureFileWatcher::RemoveListener(size_t listenerId) {
+    std::lock_guard<std::mutex> lock(m_listenerMutex);
+    m_listeners.erase(listenerId);
+}
+
+inline void RprUsdTextureFileWatcher::Notify(std::string const& filepath) {
+    std::vector<std::string> keys;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_files.find(filepath);
+        if (it == m_files.end()) {
+            return;
+        }
+        keys.assign(it->second.keys.begin(), it->second.keys.end());
+    }
+
+    std::lock_guard<std::mutex> lock(m_listenerMutex);
+    for (auto& key : keys) {
+        for (auto& entry : m_listeners) {
+            entry.second(key);
+        }
+    }
+}
+
+inline void RprUsdTextureFileWatcher::PollFiles(bool polledOnly) {
+    std::vector<std::pair<std::string, double>> files;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& entry : m_files) {
+            if (!polledOnly || entry.second.isPolled) {
+                files.emplace_back(entry.first, entry.second.modificationTime);
+            }
+        }
+    }
+    CheckFiles(files);
+}
+
+inline void RprUsdTextureFileWatcher::CheckFiles(std::vector<std::pair<std::string, double>> const& files) {
+    std::vector<std::string> modifiedFiles;
+    for (auto& file : files) {
+        double modificationTime = 0.0;
+        ArchGetModificationTime(file.first.c_str(), &modificationTime);
+        if (modificationTime != file.second) {
+            modifiedFiles.push_back(file.first);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_files.find(file.first);
+            if (it != m_files.end()) {
+                it->second.modificationTime = modificationTime;
+            }
+        }
+    }
+
+    for (auto& filepath : modifiedFiles) {
+        Notify(filepath);
+    }
+}
+
+inline void RprUsdTextureFileWatcher::PollLoop() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopCondition.wait_for(lock, m_pollInterval, [this]() { return m_stop; })) {
+        lock.unlock();
+        PollFiles(false);
+        lock.lock();
+    }
+}
+
+#ifdef ARCH_OS_LINUX
+inline void RprUsdTextureFileWatcher::RemoveWatchEntries(std::string const& filepath, WatchedFile* file) {
+    for (auto& watchEntry : file->watchEntries) {
+        auto it = m_filesByWatchEntry.find(watchEntry);
+        if (it != m_filesByWatchEntry.end()) {
+            it->second.erase(filepath);
+            if (it->second.empty()) {
+                m_filesByWatchEntry.erase(it);
+            }
+        }
+    }
+    file->watchEntries.clear();
+}
+
+inline void RprUsdTextureFileWatcher::UpdateWatchEntries(std::string const& filepath, WatchedFile* file) {
+    RemoveWatchEntries(filepath, file);
+
+    std::vector<std::string> paths{filepath};
+    // Symlink targets are edited in their own directory, the link itself stays untouched
+    auto realPath = TfRealPath(filepath);
+    if (!realPath.empty() && realPath != TfNormPath(TfAbsPath(filepath))) {
+        paths.push_back(realPath);
+    }
+
+    file->isPolled = false;
+    file->needsRewatch = false;
+    for (auto& path : paths) {
+        auto directory = TfGetPathName(path);
+        if (directory.empty()) {
+            directory = ".";
+        }
+
+        int wd;
+        auto watchIt = m_watchByDirectory.find(directory);
+        if (watchIt != m_watchByDirectory.end()) {
+            wd = watchIt->second;
+        } else {
+            wd = inotify_add_watch(m_inotifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB);
+            if (wd < 0) {
+                int error = errno;
+                file->isPolled = true;
+                if (error == ENOENT) {
+                    // The directory might be created later, e.g. while it's being replaced
+                    file->needsRewatch = true;
+                    continue;
+                }
+                // Typically ENOSPC (max_user_watches reached) or EACCES
+                TF_WARN("Failed to watch %s for texture changes (%s), falling back to polling",
+                    directory.c_str(), ArchStrerror(error).c_str());
+                continue;
+            }
+            m_watchByDirectory.emplace(directory, wd);
+        }
+
+        WatchEntry watchEntry{wd, TfGetBaseName(path)};
+        m_filesByWatchEntry[watchEntry].insert(filepath);
+        file->watchEntries.push_back(std::move(watchEntry));
+    }
+}
+
+inline void RprUsdTextureFileWatcher::OnWatchRemoved(int wd, std::set<std::string>* files) {
+    for (auto it = m_watchByDirectory.begin(); it != m_watchByDirectory.end(); ++it) {
+        if (it->second == wd) {
+            m_watchByDirectory.erase(it);
+            break;
+        }
+    }
+
+    auto begin = m_filesByWatchEntry.lower_bound(WatchEntry{wd, std::string()});
+    auto end = begin;
+    for (; end != m_filesByWatchEntry.end() && end->first.first == wd; ++end) {
+        for (auto& filepath : end->second) {
+            auto fileIt = m_files.find(filepath);
+            if (fileIt == m_files.end()) {
+                continue;
+            }
+            auto& watchEntries = fileIt->second.watchEntries;
+            watchEntries.erase(std::remove(watchEntries.begin(), watchEntries.end(), end->first), watchEntries.end());
+            fileIt->second.isPolled = true;
+            fileIt->second.needsRewatch = true;
+            files->insert(filepath);
+        }
+    }
+    m_filesByWatchEntry.erase(begin, end);
+}
+
+inline void RprUsdTextureFileWatcher::RewatchFiles() {
+    std::vector<std::pair<std::string, double>> rewatchedFiles;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& entry : m_files) {
+            if (entry.second.needsRewatch) {
+                UpdateWatchEntries(entry.first, &entry.second);
+                if (!entry.second.isPolled) {
+                    rewatchedFiles.emplace_back(entry.first, entry.second.modificationTime);
+                }
+            }
+        }
+    }
+    // Changes made after the last poll but before the watch was added produced no events
+    CheckFiles(rewatchedFiles);
+}
+
+inline void RprUsdTextureFileWatcher::InotifyLoop() {
+    alignas(struct inotify_event) char buffer[16 * 1024];
+    auto nextPollTime = std::chrono::steady_clock::now() + m_pollInterval;
+
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_stop) {
+                break;
+            }
+        }
+
+        // Files that inotify can not watch are polled alongside
+        auto now = std::chrono::steady_clock::now();
+        if (now >= nextPollTime) {
+            PollFiles(true);
+            RewatchFiles();
+            nextPollTime = now + m_pollInterval;
+        }
+
+        // Wake up periodically to check the stop flag
+        pollfd pfd = {m_inotifyFd, POLLIN, 0};
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+
+        ssize_t length = read(m_inotifyFd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            continue;
+        }
+
+        std::set<std::string> modifiedFiles;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            bool isOverflown = false;
+            for (char* ptr = buffer; ptr < buffer + length;) {
+                auto event = reinterpret_cast<struct inotify_event*>(ptr);
+                ptr += sizeof(struct inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW) {
+                    isOverflown = true;
+                    continue;
+                }
+                if (event->mask & IN_IGNORED) {
+                    OnWatchRemoved(event->wd, &modifiedFiles);
+                    continue;
+                }
+                if (!event->len) {
+                    continue;
+                }
+
+                auto it = m_filesByWatchEntry.find({event->wd, std::string(event->name)});
+                if (it != m_filesByWatchEntry.end()) {
+                    modifiedFiles.insert(it->second.begin(), it->second.end());
+                }
+            }
+
+            // Events were dropped, any file might have changed
+            if (isOverflown) {
+                for (auto& entry : m_files) {
+                    modifiedFiles.insert(entry.first);
+                }
+            }
+
+            for (auto& filepath : modifiedFiles) {
+                auto fileIt = m_files.find(filepath);
+                if (fileIt != m_files.end()) {
+                    // Same as in PollFiles, so that polling does not report a removed file again
+                    fileIt->second.modificationTime = 0.0;
+                    ArchGetModificationTime(filepath.c_str(), &fileIt->second.modificationTime);
+                    // A replaced symlink might point to another target now
+                    UpdateWatchEntries(filepath, &fileIt->second);
+                }
+            }
+        }
+
+        for (auto& filepath : modifiedFiles) {
+            Notify(filepath);
+        }
+    }
+}
+#endif // ARCH_OS_LINUX
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_TEXTURE_FILE_WATCHER_H
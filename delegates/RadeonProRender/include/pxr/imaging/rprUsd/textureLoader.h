@@ -0,0 +1,595 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_TEXTURE_LOADER_H
+#define PXR_IMAGING_RPR_USD_TEXTURE_LOADER_H
+
+#include "pxr/imaging/rprUsd/materialRegistry.h"
+#include "pxr/imaging/rprUsd/coreImage.h"
+#include "pxr/imaging/rprUsd/textureDiskCache.h"
+#include "pxr/imaging/rprUsd/textureDataPool.h"
+#include "pxr/imaging/rprUsd/textureFileWatcher.h"
+#include "pxr/imaging/rprUsd/util.h"
+#include "pxr/base/arch/fileSystem.h"
+#include "pxr/base/tf/fileUtils.h"
+#include "pxr/base/tf/getenv.h"
+#include "pxr/base/tf/stringUtils.h"
+#include "pxr/base/work/loops.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \class RprUsdTextureLoader
+///
+/// Resolves RprUsdMaterialRegistry::TextureLoadRequest in two stages. File reads and
+/// decoding of all unique textures run in parallel on the Work thread pool, then
+/// RPR images are created sequentially on the calling thread, which must be the one
+/// that owns the rpr::Context.
+///
+/// The loader is not reachable from RprUsdMaterialRegistry: the requests of
+/// registry-built materials are created inside the prebuilt CreateMaterial, queued
+/// in the registry's private request list and decoded serially by its
+/// CommitResources. Only code that creates its own TextureLoadRequest objects and
+/// passes them to Enqueue gets the parallel stage; until the registry exposes its
+/// requests, the loader is not a replacement for CommitResources. Decode
+/// throughput against thread count has not been benchmarked.
+///
+/// Requests that point to the same (filepath, colorspace, wrapType) are decoded once.
+/// Textures whose image is still alive and whose files did not change since the last
+/// commit are not decoded at all.
+///
+/// When a RprUsdTextureDiskCache is set, non-UDIM textures are mapped from the
+/// disk cache instead of being decoded, and decoded on a cache miss only once.
+///
+/// Textures are loaded in order of the priority they were enqueued with, see
+/// texturePriority.h. With RPRUSD_TEXTURE_LOAD_BATCH_SIZE (or SetBatchSize) set,
+/// a commit loads at most that many textures and leaves the rest pending, so the
+/// textures with the highest priority are loaded by the first commits.
+///
+/// Disk cached textures can be capped to a lower mip level while rendering
+/// interactively, see SetInteractiveResolutionDownscale. Capped textures are
+/// refined to full resolution by CommitRefinement once there were no
+/// interactions for RPRUSD_TEXTURE_REFINE_IDLE_MS milliseconds (1000 by default):
+/// full resolution levels are paged in on a background thread and the new images
+/// are handed to the onDidLoadTexture callbacks of the original requests.
+///
+/// With a RprUsdTextureFileWatcher set, the files of every loaded texture are
+/// watched. A texture whose file changes is reloaded by the next Commit and the
+/// new image is handed to the onDidLoadTexture callbacks of the requests that
+/// received the previous one, so materials pick up the change without a resync.
+///
+class RprUsdTextureLoader {
+public:
+    using TextureLoadRequest = RprUsdMaterialRegistry::TextureLoadRequest;
+    using Clock = std::chrono::steady_clock;
+
+    RprUsdTextureLoader()
+        : m_batchSize(size_t(std::max(TfGetenvInt("RPRUSD_TEXTURE_LOAD_BATCH_SIZE", 0), 0)))
+        , m_refineIdlePeriod(std::max(TfGetenvInt("RPRUSD_TEXTURE_REFINE_IDLE_MS", 1000), 0)) {}
+    ~RprUsdTextureLoader() { SetFileWatcher(nullptr); }
+
+    RprUsdTextureLoader(RprUsdTextureLoader const&) = delete;
+    RprUsdTextureLoader& operator=(RprUsdTextureLoader const&) = delete;
+
+    /// Higher \p priority is loaded first, see RprUsdComputeTexturePriority
+    void Enqueue(std::weak_ptr<TextureLoadRequest> request, float priority = 0.0f) {
+        m_requests.emplace_back(std::move(request), priority);
+    }
+
+    /// Maximum number of textures loaded by one commit, zero means unlimited
+    void SetBatchSize(size_t batchSize) { m_batchSize = batchSize; }
+
+    /// True if there are requests to load, or loaded textures whose files have changed
+    bool HasPendingRequests() const {
+        std::lock_guard<std::mutex> lock(m_invalidationMutex);
+        return !m_requests.empty() || !m_invalidatedFiles.empty();
+    }
+
+    /// \p fileWatcher must outlive the loader or be reset before it is destroyed
+    void SetFileWatcher(RprUsdTextureFileWatcher* fileWatcher);
+
+    /// Images created from \p diskCache entries do not go through the image cache
+    /// and therefore require \p context they are created with
+    void SetDiskCache(RprUsdTextureDiskCache const* diskCache, rpr::Context* context) {
+        m_diskCache = diskCache;
+        m_context = context;
+    }
+
+    /// \p imageCache is either RprUsdImageCache or RprUsdImageRetentionCache
+    template <typename ImageCache>
+    void Commit(ImageCache* imageCache);
+
+    /// Disk cached textures are loaded at 1/(2^downscale) resolution until refined,
+    /// meant to follow rpr:quality:interactive:resolutionDownscale in interactive mode.
+    /// Zero disables the cap.
+    void SetInteractiveResolutionDownscale(uint32_t downscale) { m_interactiveDownscale = downscale; }
+    uint32_t GetInteractiveResolutionDownscale() const { return m_interactiveDownscale; }
+
+    /// Postpones refinement, should be called on every camera or scene change
+    void NotifyInteraction() { m_lastInteractionTime = Clock::now(); }
+
+    bool HasPendingRefinement() const { return !m_cappedTextures.empty(); }
+
+    /// Swaps capped images for full resolution ones once the idle period has passed and
+    /// their data is paged in. Must be called on the thread that owns the rpr::Context.
+    /// Returns the number of refined textures.
+    size_t CommitRefinement();
+
+private:
+    struct Key {
+        std::string filepath;
+        std::string colorspace;
+        rpr::ImageWrapType wrapType;
+
+        bool operator==(Key const& rhs) const {
+            return wrapType == rhs.wrapType && colorspace == rhs.colorspace && filepath == rhs.filepath;
+        }
+
+        struct Hash {
+            size_t operator()(Key const& key) const {
+                size_t hash = std::hash<std::string>{}(key.filepath);
+                hash ^= std::hash<std::string>{}(key.colorspace) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+                hash ^= std::hash<int>{}(key.wrapType) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+                return hash;
+            }
+        };
+    };
+
+    struct Tile {
+        uint32_t id;
+        std::string filepath;
+        double modificationTime;
+        std::shared_ptr<RprUsdTextureData> data;
+        std::shared_ptr<RprUsdTextureDiskCache::MappedTexture> mappedData;
+    };
+
+    struct LoadedTexture {
+        std::weak_ptr<RprUsdCoreImage> image;
+        std::vector<std::pair<uint32_t, double>> tileModificationTimes;
+        // The disk cache narrows images to this many components, zero keeps all of them
+        uint32_t numComponents = 0;
+
+        // Requests the image was handed to, they are resolved again when a file changes
+        std::vector<std::weak_ptr<TextureLoadRequest>> requests;
+        float priority = 0.0f;
+    };
+
+    struct CappedTexture {
+        Key key;
+        std::shared_ptr<RprUsdTextureDiskCache::MappedTexture> mappedData;
+        std::vector<std::weak_ptr<TextureLoadRequest>> requests;
+    };
+
+    struct UniqueTexture {
+        Key key;
+        uint32_t numComponentsRequired = 0;
+        float priority = 0.0f;
+        bool isDeferred = false;
+        std::vector<std::shared_ptr<TextureLoadRequest>> requests;
+
+        std::vector<Tile> tiles;
+        std::shared_ptr<RprUsdCoreImage> image;
+
+        bool IsUDIM() const { return tiles.size() != 1 || tiles[0].id != 0; }
+    };
+
+    static void ResolveTiles(UniqueTexture* texture);
+    bool IsUpToDate(UniqueTexture* texture);
+
+    // Other watcher users key files by path too, a prefix keeps Unwatch from dropping their watches
+    static const char* GetWatchKeyPrefix() { return "rprUsdTextureLoader:"; }
+    static std::string GetWatchKey(std::string const& filepath) { return GetWatchKeyPrefix() + filepath; }
+
+    void EnqueueInvalidated();
+    void Track(UniqueTexture const& texture);
+
+private:
+    std::vector<std::pair<std::weak_ptr<TextureLoadRequest>, float>> m_requests;
+    std::unordered_map<Key, LoadedTexture, Key::Hash> m_loadedTextures;
+    size_t m_batchSize;
+
+    RprUsdTextureDiskCache const* m_diskCache = nullptr;
+    rpr::Context* m_context = nullptr;
+
+    uint32_t m_interactiveDownscale = 0;
+    std::chrono::milliseconds m_refineIdlePeriod;
+    Clock::time_point m_lastInteractionTime;
+    std::unordered_map<Key, CappedTexture, Key::Hash> m_cappedTextures;
+    std::future<void> m_refinementPrefetch;
+
+    RprUsdTextureFileWatcher* m_fileWatcher = nullptr;
+    size_t m_fileWatcherListenerId = 0;
+    // Filled on the watcher thread
+    mutable std::mutex m_invalidationMutex;
+    std::set<std::string> m_invalidatedFiles;
+};
+
+inline void RprUsdTextureLoader::SetFileWatcher(RprUsdTextureFileWatcher* fileWatcher) {
+    if (m_fileWatcher) {
+        m_fileWatcher->RemoveListener(m_fileWatcherListenerId);
+        for (auto& entry : m_loadedTextures) {
+            m_fileWatcher->Unwatch(GetWatchKey(entry.first.filepath));
+        }
+    }
+
+    m_fileWatcher = fileWatcher;
+    if (m_fileWatcher) {
+        m_fileWatcherListenerId = m_fileWatcher->AddListener(
+            [this](std::string const& key) {
+                if (TfStringStartsWith(key, GetWatchKeyPrefix())) {
+                    std::lock_guard<std::mutex> lock(m_invalidationMutex);
+                    m_invalidatedFiles.insert(key.substr(std::strlen(GetWatchKeyPrefix())));
+                }
+            }
+        );
+    }
+}
+
+inline void RprUsdTextureLoader::EnqueueInvalidated() {
+    std::set<std::string> invalidatedFiles;
+    {
+        std::lock_guard<std::mutex> lock(m_invalidationMutex);
+        invalidatedFiles.swap(m_invalidatedFiles);
+    }
+    if (invalidatedFiles.empty()) {
+        return;
+    }
+
+    for (auto it = m_loadedTextures.begin(); it != m_loadedTextures.end();) {
+        if (!invalidatedFiles.count(it->first.filepath)) {
+            ++it;
+            continue;
+        }
+
+        for (auto& request : it->second.requests) {
+            if (!request.expired()) {
+                m_requests.emplace_back(request, it->second.priority);
+            }
+        }
+        m_cappedTextures.erase(it->first);
+        it = m_loadedTextures.erase(it);
+    }
+}
+
+inline void RprUsdTextureLoader::Track(UniqueTexture const& texture) {
+    auto it = m_loadedTextures.find(texture.key);
+    if (it == m_loadedTextures.end()) {
+        return;
+    }
+
+    auto& loadedTexture = it->second;
+    loadedTexture.priority = std::max(loadedTexture.priority, texture.priority);
+    loadedTexture.requests.erase(
+        std::remove_if(loadedTexture.requests.begin(), loadedTexture.requests.end(),
+            [](std::weak_ptr<TextureLoadRequest> const& request) { return request.expired(); }),
+        loadedTexture.requests.end());
+    for (auto& request : texture.requests) {
+        bool isTracked = std::any_of(loadedTexture.requests.begin(), loadedTexture.requests.end(),
+            [&request](std::weak_ptr<TextureLoadRequest> const& tracked) { return tracked.lock() == request; });
+        if (!isTracked) {
+            loadedTexture.requests.push_back(request);
+        }
+    }
+
+    if (m_fileWatcher) {
+        // Tiles are watched under the texture path, that's what the image is loaded by
+        for (auto& tile : texture.tiles) {
+            m_fileWatcher->Watch(tile.filepath, GetWatchKey(texture.key.filepath));
+        }
+    }
+}
+
+inline void RprUsdTextureLoader::ResolveTiles(UniqueTexture* texture) {
+    std::string formatString;
+    if (RprUsdGetUDIMFormatString(texture->key.filepath, &formatString)) {
+        constexpr uint32_t kStartTile = 1001;
+        constexpr uint32_t kEndTile = 1100;
+
+        for (uint32_t tileId = kStartTile; tileId <= kEndTile; ++tileId) {
+            auto tilePath = TfStringPrintf(formatString.c_str(), tileId);
+            if (TfIsFile(tilePath)) {
+                texture->tiles.push_back({tileId, std::move(tilePath), 0.0, nullptr, nullptr});
+            }
+        }
+    } else {
+        // Tile with zero id is treated by RprUsdCoreImage as a regular non-UDIM image
+        texture->tiles.push_back({0, texture->key.filepath, 0.0, nullptr, nullptr});
+    }
+
+    for (auto& tile : texture->tiles) {
+        ArchGetModificationTime(tile.filepath.c_str(), &tile.modificationTime);
+    }
+}
+
+inline bool RprUsdTextureLoader::IsUpToDate(UniqueTexture* texture) {
+    auto it = m_loadedTextures.find(texture->key);
+    if (it == m_loadedTextures.end()) {
+        return false;
+    }
+
+    auto image = it->second.image.lock();
+    if (!image) {
+        return false;
+    }
+
+    // An image narrowed for e.g. a roughness input can not serve a color input
+    uint32_t loadedComponents = it->second.numComponents;
+    if (loadedComponents != 0 &&
+        (texture->numComponentsRequired == 0 || texture->numComponentsRequired > loadedComponents)) {
+        return false;
+    }
+
+    auto& loadedTiles = it->second.tileModificationTimes;
+    if (loadedTiles.size() != texture->tiles.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < loadedTiles.size(); ++i) {
+        if (loadedTiles[i].first != texture->tiles[i].id ||
+            loadedTiles[i].second != texture->tiles[i].modificationTime) {
+            return false;
+        }
+    }
+
+    texture->image = std::move(image);
+    return true;
+}
+
+template <typename ImageCache>
+void RprUsdTextureLoader::Commit(ImageCache* imageCache) {
+    EnqueueInvalidated();
+    if (m_requests.empty()) {
+        return;
+    }
+
+    std::vector<UniqueTexture> uniqueTextures;
+    std::unordered_map<Key, size_t, Key::Hash> uniqueTextureIndices;
+    for (auto& entry : m_requests) {
+        auto request = entry.first.lock();
+        if (!request) {
+            continue;
+        }
+
+        Key key{request->filepath, request->colorspace, request->wrapType};
+        auto status = uniqueTextureIndices.emplace(key, uniqueTextures.size());
+        if (status.second) {
+            uniqueTextures.emplace_back();
+            uniqueTextures.back().key = std::move(key);
+            uniqueTextures.back().priority = entry.second;
+        }
+
+        auto& texture = uniqueTextures[status.first->second];
+        texture.numComponentsRequired = std::max(texture.numComponentsRequired, request->numComponentsRequired);
+        texture.priority = std::max(texture.priority, entry.second);
+        texture.requests.push_back(std::move(request));
+    }
+    m_requests.clear();
+
+    std::stable_sort(uniqueTextures.begin(), uniqueTextures.end(),
+        [](UniqueTexture const& lhs, UniqueTexture const& rhs) { return lhs.priority > rhs.priority; });
+
+    // Directory listing and stat calls are as slow as decoding on network storage, so they go wide too
+    WorkParallelForN(uniqueTextures.size(),
+        [&uniqueTextures](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                ResolveTiles(&uniqueTextures[i]);
+            }
+        }
+    );
+
+    std::vector<std::pair<UniqueTexture*, Tile*>> tilesToDecode;
+    size_t numTexturesToLoad = 0;
+    for (auto& texture : uniqueTextures) {
+        if (IsUpToDate(&texture)) {
+            continue;
+        }
+
+        if (m_batchSize && numTexturesToLoad >= m_batchSize) {
+            texture.isDeferred = true;
+            for (auto& request : texture.requests) {
+                m_requests.emplace_back(request, texture.priority);
+            }
+            continue;
+        }
+
+        ++numTexturesToLoad;
+        for (auto& tile : texture.tiles) {
+            tilesToDecode.emplace_back(&texture, &tile);
+        }
+    }
+
+    auto diskCache = m_diskCache;
+    WorkParallelForN(tilesToDecode.size(),
+        [&tilesToDecode, diskCache](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                auto texture = tilesToDecode[i].first;
+                auto tile = tilesToDecode[i].second;
+                if (diskCache && !texture->IsUDIM()) {
+                    tile->mappedData = diskCache->FindOrCreate(tile->filepath, texture->key.colorspace, texture->numComponentsRequired);
+                    if (tile->mappedData) {
+                        continue;
+                    }
+                }
+
+                tile->data = RprUsdTextureDataPool::GetInstance().Get(tile->filepath);
+                if (!tile->data) {
+                    TF_RUNTIME_ERROR("Failed to load %s", tile->filepath.c_str());
+                }
+            }
+        }
+    );
+
+    // rpr::Context is not thread-safe, images are created on the calling thread
+    for (auto& texture : uniqueTextures) {
+        if (texture.isDeferred) {
+            continue;
+        }
+
+        if (!texture.image) {
+            std::vector<RprUsdCoreImage::UDIMTile> tiles;
+            std::vector<std::pair<uint32_t, double>> tileModificationTimes;
+            for (auto& tile : texture.tiles) {
+                if (tile.data) {
+                    tiles.emplace_back(tile.id, tile.data.get());
+                }
+                tileModificationTimes.emplace_back(tile.id, tile.modificationTime);
+            }
+
+            // A freshly loaded texture supersedes whatever refinement was pending for it
+            m_cappedTextures.erase(texture.key);
+
+            if (!texture.IsUDIM() && texture.tiles[0].mappedData) {
+                auto& mappedData = texture.tiles[0].mappedData;
+                uint32_t level = std::min(m_interactiveDownscale, mappedData->GetNumLevels() - 1);
+                texture.image.reset(RprUsdTextureDiskCache::CreateImage(
+                    m_context, *mappedData, texture.key.wrapType, level));
+
+                if (texture.image && level > 0) {
+                    auto& cappedTexture = m_cappedTextures[texture.key];
+                    cappedTexture.key = texture.key;
+                    cappedTexture.mappedData = mappedData;
+
+                    // Give the capped image a chance to be seen before it's refined
+                    NotifyInteraction();
+                }
+            } else if (!tiles.empty()) {
+                texture.image = imageCache->GetImage(
+                    texture.key.filepath, texture.key.colorspace, texture.key.wrapType,
+                    tiles, texture.numComponentsRequired);
+            }
+
+            if (texture.image) {
+                auto& loadedTexture = m_loadedTextures[texture.key];
+                loadedTexture.image = texture.image;
+                loadedTexture.tileModificationTimes = std::move(tileModificationTimes);
+                loadedTexture.numComponents = texture.numComponentsRequired;
+            } else {
+                m_loadedTextures.erase(texture.key);
+            }
+        }
+
+        // Requests bound to a capped image receive the refined one later too
+        auto cappedIt = m_cappedTextures.find(texture.key);
+        if (cappedIt != m_cappedTextures.end()) {
+            cappedIt->second.requests.insert(cappedIt->second.requests.end(), texture.requests.begin(), texture.requests.end());
+        }
+
+        for (auto& request : texture.requests) {
+            if (request->onDidLoadTexture) {
+                request->onDidLoadTexture(texture.image);
+            }
+        }
+        Track(texture);
+    }
+
+    std::set<std::string> releasedFiles;
+    for (auto it = m_loadedTextures.begin(); it != m_loadedTextures.end();) {
+        if (it->second.image.expired()) {
+            releasedFiles.insert(it->first.filepath);
+            it = m_loadedTextures.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (m_fileWatcher) {
+        // The same file might still be loaded with another colorspace or wrap type
+        for (auto& entry : m_loadedTextures) {
+            releasedFiles.erase(entry.first.filepath);
+        }
+        for (auto& filepath : releasedFiles) {
+            m_fileWatcher->Unwatch(GetWatchKey(filepath));
+        }
+    }
+}
+
+inline size_t RprUsdTextureLoader::CommitRefinement() {
+    if (m_cappedTextures.empty() || Clock::now() - m_lastInteractionTime < m_refineIdlePeriod) {
+        return 0;
+    }
+
+    if (!m_refinementPrefetch.valid()) {
+        // Touch every page of the base levels so that the upload does not stall on disk reads
+        std::vector<std::shared_ptr<RprUsdTextureDiskCache::MappedTexture>> mappedTextures;
+        for (auto& entry : m_cappedTextures) {
+            mappedTextures.push_back(entry.second.mappedData);
+        }
+        m_refinementPrefetch = std::async(std::launch::async,
+            [mappedTextures]() {
+                constexpr size_t kPageSize = 4096;
+                for (auto& mappedTexture : mappedTextures) {
+                    auto format = mappedTexture->GetFormat();
+                    auto level = mappedTexture->GetLevel(0);
+                    auto data = static_cast<volatile uint8_t const*>(level.data);
+                    size_t size = size_t(level.width) * level.height * RprUsdGetImageFormatPixelSize(format);
+                    for (size_t offset = 0; offset < size; offset += kPageSize) {
+                        (void)data[offset];
+                    }
+                }
+            }
+        );
+        return 0;
+    }
+
+    if (m_refinementPrefetch.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return 0;
+    }
+    m_refinementPrefetch.get();
+
+    size_t numRefinedTextures = 0;
+    for (auto& entry : m_cappedTextures) {
+        auto& cappedTexture = entry.second;
+
+        std::vector<std::shared_ptr<TextureLoadRequest>> requests;
+        for (auto& requestHandle : cappedTexture.requests) {
+            if (auto request = requestHandle.lock()) {
+                requests.push_back(std::move(request));
+            }
+        }
+
+        // Nobody uses the capped image anymore
+        auto loadedIt = m_loadedTextures.find(cappedTexture.key);
+        if (requests.empty() || loadedIt == m_loadedTextures.end() || loadedIt->second.image.expired()) {
+            continue;
+        }
+
+        std::shared_ptr<RprUsdCoreImage> image(RprUsdTextureDiskCache::CreateImage(
+            m_context, *cappedTexture.mappedData, cappedTexture.key.wrapType));
+        if (!image) {
+            continue;
+        }
+
+        loadedIt->second.image = image;
+        for (auto& request : requests) {
+            if (request->onDidLoadTexture) {
+                request->onDidLoadTexture(image);
+            }
+        }
+        ++numRefinedTextures;
+    }
+    m_cappedTextures.clear();
+
+    return numRefinedTextures;
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_TEXTURE_LOADER_H
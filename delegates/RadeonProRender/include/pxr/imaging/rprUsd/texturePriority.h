@@ -0,0 +1,126 @@
+/************************************************************************
+Copyright 2020 Advanced Micro Devices, Inc
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+************************************************************************/
+
+#ifndef PXR_IMAGING_RPR_USD_TEXTURE_PRIORITY_H
+#define PXR_IMAGING_RPR_USD_TEXTURE_PRIORITY_H
+
+#include "pxr/pxr.h"
+#include "pxr/base/gf/bbox3d.h"
+#include "pxr/base/gf/matrix4d.h"
+#include "pxr/base/tf/stringUtils.h"
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// Fraction of the screen covered by the projection of \p bbox, in [0, 1].
+/// \p viewProjection transforms world space to clip space, as in HdCamera
+/// (view matrix multiplied by the projection matrix).
+/// Boxes that cross the near plane are assumed to fill the screen.
+inline float RprUsdComputeScreenCoverage(GfBBox3d const& bbox, GfMatrix4d const& viewProjection) {
+    auto& range = bbox.GetRange();
+    if (range.IsEmpty()) {
+        return 0.0f;
+    }
+
+    GfMatrix4d m = bbox.GetMatrix() * viewProjection;
+
+    double minX = 1.0, minY = 1.0, maxX = -1.0, maxY = -1.0;
+    int numCornersBehind = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        auto p = range.GetCorner(i);
+        double x = p[0] * m[0][0] + p[1] * m[1][0] + p[2] * m[2][0] + m[3][0];
+        double y = p[0] * m[0][1] + p[1] * m[1][1] + p[2] * m[2][1] + m[3][1];
+        double w = p[0] * m[0][3] + p[1] * m[1][3] + p[2] * m[2][3] + m[3][3];
+        if (w <= 1e-6) {
+            ++numCornersBehind;
+            continue;
+        }
+        minX = std::min(minX, x / w);
+        minY = std::min(minY, y / w);
+        maxX = std::max(maxX, x / w);
+        maxY = std::max(maxY, y / w);
+    }
+
+    if (numCornersBehind == 8) {
+        return 0.0f;
+    } else if (numCornersBehind > 0) {
+        return 1.0f;
+    }
+
+    double width = std::min(maxX, 1.0) - std::max(minX, -1.0);
+    double height = std::min(maxY, 1.0) - std::max(minY, -1.0);
+    if (width <= 0.0 || height <= 0.0) {
+        return 0.0f;
+    }
+    return float(width * height / 4.0);
+}
+
+/// Relative importance of a texture bound to material input \p inputName for a
+/// useful first frame: color defining inputs come first, detail maps last.
+/// Known inputs of UsdPreviewSurface, RPR Uber and standard_surface are matched
+/// by name, other names by keyword, secondary lobes (specular_color, coat_color,
+/// etc.) before the generic color keywords.
+inline float RprUsdGetTextureInputWeight(std::string const& inputName) {
+    static const std::unordered_map<std::string, float> kWeights = {
+        {"color", 1.0f},
+        {"diffusecolor", 1.0f},
+        {"diffuse_color", 1.0f},
+        {"uber_diffuse_color", 1.0f},
+        {"base_color", 1.0f},
+        {"emissivecolor", 1.0f},
+        {"emission_color", 1.0f},
+        {"uber_emission_color", 1.0f},
+        {"opacity", 0.75f},
+        {"transparency", 0.75f},
+        {"uber_transparency", 0.75f},
+        {"normal", 0.5f},
+        {"bump", 0.5f},
+        {"uber_diffuse_normal", 0.5f},
+        {"displacement", 0.3f},
+    };
+
+    auto name = TfStringToLower(inputName);
+    auto it = kWeights.find(name);
+    if (it != kWeights.end()) {
+        return it->second;
+    }
+
+    auto contains = [&name](const char* token) { return name.find(token) != std::string::npos; };
+    if (contains("displacement")) {
+        return 0.3f;
+    } else if (contains("normal") || contains("bump")) {
+        return 0.5f;
+    } else if (contains("rough") || contains("metal") || contains("specular") || contains("reflect") ||
+        contains("coat") || contains("sheen") || contains("subsurface") || contains("sss") ||
+        contains("refract") || contains("transmission")) {
+        return 0.4f;
+    } else if (contains("opacity") || contains("transparency") || contains("cutout")) {
+        return 0.75f;
+    } else if (contains("color") || contains("albedo") || contains("diffuse") || contains("emissi")) {
+        return 1.0f;
+    }
+    return 0.25f;
+}
+
+/// Load priority of a texture, higher priorities are loaded first.
+/// Input weight alone still orders textures whose geometry is off screen.
+inline float RprUsdComputeTexturePriority(float screenCoverage, float inputWeight) {
+    return inputWeight * (0.01f + std::max(screenCoverage, 0.0f));
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXR_IMAGING_RPR_USD_TEXTURE_PRIORITY_H
@@ -0,0 +1,265 @@
+# Copyright 2020 Advanced Micro Devices, Inc
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#     http://www.apache.org/licenses/LICENSE-2.0
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+"""RPR kernel cache management, see RprUsdKernelCacheManager in rprUsd.
+
+Shares the index file format with the C++ implementation. Usable as a module
+from the usdview menu and as a command line tool:
+
+    python -m rpr.kernelCacheManager [--cache-dir DIR] [--max-size-mb N] {stats,trim,clear}
+"""
+import argparse
+import json
+import os
+import sys
+import tempfile
+import time
+
+INDEX_FILE_NAME = 'rprUsdKernelCacheIndex.json'
+INDEX_VERSION = 1
+# Kernels modified recently might still be written by another session
+WRITE_GRACE_PERIOD = 600.0
+
+
+def getDefaultCacheDir():
+    from rpr import RprUsd
+    return RprUsd.Config.GetKernelCacheDir()
+
+
+def _getSize(path):
+    """Size of path, 0 if it's missing or was removed by another session"""
+    try:
+        return os.path.getsize(path)
+    except OSError:
+        return 0
+
+
+def _getModificationTime(path):
+    try:
+        return os.path.getmtime(path)
+    except OSError:
+        return None
+
+
+def _getAccessTime(path):
+    """RPR loads kernels by itself, the access time is the only trace of a load.
+    0 if the file is missing"""
+    try:
+        return os.path.getatime(path)
+    except OSError:
+        return 0.0
+
+
+def _removeFile(path):
+    try:
+        os.remove(path)
+    except OSError:
+        # Removed by another session or not removable, the next scan retries
+        pass
+
+
+def getDefaultMaxSize():
+    try:
+        maxSizeMb = int(os.environ.get('RPRUSD_KERNEL_CACHE_MAX_SIZE_MB', 4096))
+    except ValueError:
+        maxSizeMb = 4096
+    return max(maxSizeMb, 0) << 20
+
+
+class Stats(object):
+    def __init__(self):
+        self.numEntries = 0
+        self.totalSize = 0
+        self.numEvictedEntries = 0
+        self.evictedSize = 0
+        self.numCorruptEntries = 0
+
+    def __str__(self):
+        return ('{} entries, {:.1f} MB; evicted {} entries, {:.1f} MB; removed {} corrupt entries'.format(
+            self.numEntries, self.totalSize / 1048576.0,
+            self.numEvictedEntries, self.evictedSize / 1048576.0,
+            self.numCorruptEntries))
+
+
+class KernelCacheManager(object):
+    def __init__(self, cacheDir=None, maxSize=None):
+        self.cacheDir = cacheDir if cacheDir is not None else getDefaultCacheDir()
+        self.maxSize = maxSize if maxSize is not None else getDefaultMaxSize()
+        self._entries = None
+        self._stats = Stats()
+
+    def _path(self, name):
+        return os.path.join(self.cacheDir, name)
+
+    def _remove(self, name):
+        _removeFile(self._path(name))
+        if name.endswith('.bin'):
+            _removeFile(self._path(name + '.check'))
+        self._entries.pop(name, None)
+
+    def _isCorrupt(self, name, now):
+        kernelPath = self._path(name)
+        checkPath = kernelPath + '.check'
+        kernelTime = _getModificationTime(kernelPath)
+        if kernelTime is None or now - kernelTime < WRITE_GRACE_PERIOD:
+            return False
+        checkTime = _getModificationTime(checkPath)
+        if checkTime is None:
+            return True
+        if _getSize(kernelPath) == 0 or _getSize(checkPath) == 0:
+            return True
+        # RPR writes the check file after the kernel
+        return checkTime < kernelTime
+
+    def _loadIndex(self):
+        if self._entries is not None:
+            return
+        self._entries = {}
+        try:
+            with open(self._path(INDEX_FILE_NAME)) as indexFile:
+                index = json.load(indexFile)
+        except (IOError, OSError, ValueError):
+            return
+        if not isinstance(index, dict) or index.get('version') != INDEX_VERSION:
+            return
+        for name, entry in index.get('entries', {}).items():
+            if isinstance(entry, dict) and isinstance(entry.get('lastUse'), (int, float)):
+                self._entries[name] = {'size': 0, 'lastUse': float(entry['lastUse'])}
+
+    def _saveIndex(self):
+        index = {
+            'version': INDEX_VERSION,
+            'entries': {name: {'size': entry['size'], 'lastUse': float(entry['lastUse'])}
+                        for name, entry in self._entries.items()},
+        }
+        indexPath = self._path(INDEX_FILE_NAME)
+        # A unique name, another session might save the index at the same time
+        try:
+            tmpFile, tmpPath = tempfile.mkstemp(prefix=INDEX_FILE_NAME + '.', dir=self.cacheDir)
+        except (IOError, OSError):
+            return
+        try:
+            with os.fdopen(tmpFile, 'w') as indexFile:
+                json.dump(index, indexFile)
+            os.replace(tmpPath, indexPath)
+        except (IOError, OSError):
+            _removeFile(tmpPath)
+
+    def scan(self):
+        """Synchronizes the index with the directory and removes corrupt entries"""
+        self._loadIndex()
+        if not os.path.isdir(self.cacheDir):
+            self._entries = {}
+            return
+
+        now = time.time()
+        try:
+            files = set(name for name in os.listdir(self.cacheDir) if os.path.isfile(self._path(name)))
+        except OSError:
+            return
+        # Other sessions write and remove entries concurrently, so any file
+        # listed above might be missing by the time it's inspected
+        entries = {}
+        for name in sorted(files):
+            if name.endswith('.bin.check'):
+                checkTime = _getModificationTime(self._path(name))
+                if name[:-6] not in files and checkTime is not None and now - checkTime >= WRITE_GRACE_PERIOD:
+                    _removeFile(self._path(name))
+                continue
+            if not name.endswith('.bin') and not name.endswith('.cache'):
+                continue
+
+            if name.endswith('.bin') and self._isCorrupt(name, now):
+                print('RPR: removing corrupt kernel cache entry: {}'.format(self._path(name)))
+                self._remove(name)
+                self._stats.numCorruptEntries += 1
+                continue
+
+            path = self._path(name)
+            modificationTime = _getModificationTime(path)
+            if modificationTime is None:
+                continue
+            # Kernels within the write grace period might have no check file yet
+            size = _getSize(path)
+            if name.endswith('.bin'):
+                size += _getSize(path + '.check')
+            previous = self._entries.get(name)
+            lastUse = max(modificationTime, _getAccessTime(path), previous['lastUse'] if previous else 0.0)
+            entries[name] = {'size': size, 'lastUse': lastUse}
+        self._entries = entries
+        self._saveIndex()
+
+    def markUsed(self, name):
+        self._loadIndex()
+        if name in self._entries:
+            self._entries[name]['lastUse'] = time.time()
+            self._saveIndex()
+
+    def getEntries(self):
+        """(name, size, lastUse) tuples from the least to the most recently used"""
+        self._loadIndex()
+        entries = [(name, entry['size'], entry['lastUse']) for name, entry in self._entries.items()]
+        return sorted(entries, key=lambda entry: entry[2])
+
+    def trim(self):
+        """Evicts the least recently used entries until the cache fits into maxSize"""
+        self.scan()
+        entries = self.getEntries()
+        totalSize = sum(entry[1] for entry in entries)
+        numEvicted = 0
+        for name, size, _ in entries:
+            if totalSize <= self.maxSize:
+                break
+            self._remove(name)
+            totalSize -= size
+            self._stats.evictedSize += size
+            numEvicted += 1
+        self._stats.numEvictedEntries += numEvicted
+        if numEvicted:
+            self._saveIndex()
+        return numEvicted
+
+    def clear(self):
+        self.scan()
+        numRemoved = len(self._entries)
+        for name in list(self._entries):
+            self._remove(name)
+        self._saveIndex()
+        return numRemoved
+
+    def getStats(self):
+        self._loadIndex()
+        self._stats.numEntries = len(self._entries)
+        self._stats.totalSize = sum(entry['size'] for entry in self._entries.values())
+        return self._stats
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description='Manage the RPR kernel cache')
+    parser.add_argument('--cache-dir', help='kernel cache directory, RprUsd config value by default')
+    parser.add_argument('--max-size-mb', type=int, help='size limit, RPRUSD_KERNEL_CACHE_MAX_SIZE_MB or 4096 by default')
+    parser.add_argument('command', choices=('stats', 'trim', 'clear'))
+    args = parser.parse_args(argv)
+
+    maxSize = args.max_size_mb << 20 if args.max_size_mb is not None else None
+    manager = KernelCacheManager(args.cache_dir, maxSize)
+    if args.command == 'trim':
+        manager.trim()
+    elif args.command == 'clear':
+        manager.clear()
+    else:
+        manager.scan()
+    print('RPR kernel cache {}: {}'.format(manager.cacheDir, manager.getStats()))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
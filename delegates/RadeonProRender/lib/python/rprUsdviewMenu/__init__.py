@@ -21,6 +21,7 @@ import os
 import glob
 
 from rpr import RprUsd
+from rpr.kernelCacheManager import KernelCacheManager
 
 def setCacheDir(usdviewApi, type, startDirectory, setter):
     directory = QtWidgets.QFileDialog.getExistingDirectory(
@@ -36,18 +37,29 @@ def SetTextureCacheDir(usdviewApi):
 def SetKernelCacheDir(usdviewApi):
     setCacheDir(usdviewApi, 'Kernel', RprUsd.Config.GetKernelCacheDir(), RprUsd.Config.SetKernelCacheDir)
 
-def clearCache(cache_dir):
+def clearCache(cache_dir, patterns=('*.bin.check', '*.bin', '*.cache', '*.rprtex')):
+    # *.rprtex are RprUsdTextureDiskCache entries
     num_files_removed = 0
-    for pattern in ('*.bin.check', '*.bin', '*.cache'):
+    for pattern in patterns:
         for cache_file in glob.iglob(os.path.join(cache_dir, pattern)):
             os.remove(cache_file)
             num_files_removed += 1
     print('RPR: removed {} cache files'.format(num_files_removed))
 
+def getMtlxCacheDir():
+    # Same default as RprUsdMtlxDocumentCache
+    return os.environ.get('RPRUSD_MTLX_CACHE_DIR') or os.path.join(RprUsd.Config.GetTextureCacheDir(), 'mtlx')
+
 def ClearTextureCache(usdviewApi):
     clearCache(RprUsd.Config.GetTextureCacheDir())
+    clearCache(getMtlxCacheDir(), patterns=('*.mtlx',))
 def ClearKernelCache(usdviewApi):
-    clearCache(RprUsd.Config.GetKernelCacheDir())
+    manager = KernelCacheManager(RprUsd.Config.GetKernelCacheDir())
+    print('RPR: removed {} kernel cache entries'.format(manager.clear()))
+def TrimKernelCache(usdviewApi):
+    manager = KernelCacheManager(RprUsd.Config.GetKernelCacheDir())
+    manager.trim()
+    print('RPR: kernel cache: {}'.format(manager.getStats()))
 
 def getRprPath(_pathCache=[None]):
     if _pathCache[0]:
@@ -161,6 +173,10 @@ class RprPluginContainer(PluginContainer):
             "RprPluginContainer.clearKernelCache",
             "Clear Kernel Cache",
             ClearKernelCache)
+        self.trimKernelCache = plugRegistry.registerCommandPlugin(
+            "RprPluginContainer.trimKernelCache",
+            "Trim Kernel Cache",
+            TrimKernelCache)
 
         self.restartAction = plugRegistry.registerCommandPlugin(
             "RprPluginContainer.restartAction",
@@ -187,6 +203,7 @@ class RprPluginContainer(PluginContainer):
         cacheMenu.addItem(self.setKernelCacheDir)
         cacheMenu.addItem(self.clearTextureCache)
         cacheMenu.addItem(self.clearKernelCache)
+        cacheMenu.addItem(self.trimKernelCache)
 
         rprMenu.addItem(self.restartAction)
 